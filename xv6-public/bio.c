@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -8,6 +8,8 @@
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
+//     bwrite_async and biowait let several writes be in flight.
+// * To fetch a block that will be needed soon, call breadahead.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -17,46 +19,195 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_ASYNC: nobody waits for the I/O; the disk driver
+//     calls biodone to release the buffer.
+// * B_RA: the buffer was read ahead and nobody has used it yet.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own lock and its own LRU list, so lookups of different
+// blocks on different CPUs do not contend.  A miss first recycles
+// the least recently used free buffer of its own bucket; only if
+// the bucket has none does it take bcache.lock and steal one from
+// another bucket.  Holding bcache.lock while stealing means at most
+// one CPU ever holds two bucket locks, so there is no lock-order
+// deadlock between buckets.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
-
-  // Linked list of all buffers, through prev/next.
+  // Linked list of buffers in this bucket, through prev/next.
   // head.next is most recently used.
   struct buf head;
+
+  // Statistics, protected by lock.
+  uint nlookup;       // bget calls that hashed here
+  uint nhit;          // ... that found the block cached
+  uint ncontend;      // ... that found the lock already held
+};
+
+struct {
+  struct spinlock lock;   // serializes stealing between buckets
+  int nbuf;               // number of buffers, chosen at boot
+  uint nsteal;            // buffers moved between buckets
+
+  // Readahead statistics, updated atomically.
+  uint nraissue;          // blocks queued by breadahead
+  uint nrahit;            // ... later found by bread
+  uint nrawaste;          // ... recycled without being used
+  uint nsyncread;         // bread calls that waited for the disk
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// Acquire a bucket lock, counting the acquisition as contended
+// if some other CPU held it when we arrived.
+static void
+bucketlock(struct bucket *bk)
+{
+  int busy;
+
+  busy = bk->lock.locked;
+  acquire(&bk->lock);
+  if(busy)
+    bk->ncontend++;
+}
+
+// Unlink b from its bucket and push it on the MRU end of bk.
+// Caller holds the lock of both buckets.
+static void
+bmovehead(struct bucket *bk, struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
 /*
   初始化buffer cache
-  构建双向链表
+  根据空闲内存决定buffer数量,并分散到各个hash bucket
+  Must run after kinit2(), so that the size reflects all of memory.
  */
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct buf *b, *bend;
+  uchar *data, *dend;
+  int n;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  // Spend 1/BCACHEFRAC of free memory on buffers,
+  // but never less than NBUF or more than NBUFMAX.
+  if(BSIZE > PGSIZE || PGSIZE % BSIZE != 0)
+    panic("binit: BSIZE");
+  n = (uint)kfreepages() / BCACHEFRAC * PGSIZE / (sizeof(struct buf) + BSIZE);
+  if(n < NBUF)
+    n = NBUF;
+  if(n > NBUFMAX)
+    n = NBUFMAX;
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Carve buf structs and their data blocks out of
+  // whole pages and deal them round-robin into the buckets.
+  b = bend = 0;
+  data = dend = 0;
+  for(bcache.nbuf = 0; bcache.nbuf < n; bcache.nbuf++){
+    if(b == bend){
+      if((b = (struct buf*)kalloc()) == 0)
+        break;
+      memset(b, 0, PGSIZE);
+      bend = b + PGSIZE/sizeof(struct buf);
+    }
+    if(data == dend){
+      if((data = (uchar*)kalloc()) == 0)
+        break;
+      dend = data + PGSIZE;
+    }
+    bk = &bcache.bucket[bcache.nbuf % NBUCKET];
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = data;
+    b->next = bk->head.next;
+    b->prev = &bk->head;
+    bk->head.next->prev = b;
+    bk->head.next = b;
+    b++;
+    data += BSIZE;
+  }
+  if(bcache.nbuf < NBUF)
+    panic("binit: out of memory");
+}
+
+// Number of buffers in the cache.
+int
+bcachesize(void)
+{
+  return bcache.nbuf;
+}
+
+// Look in bucket bk for block (dev, blockno).  If it is cached,
+// take a reference and return it.  Caller holds bk->lock.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
+}
+
+// Find the least recently used buffer in bk that can be recycled.
+// Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+// Caller holds bk->lock.
+static struct buf*
+bvictim(struct bucket *bk)
+{
+  struct buf *b;
+
+  for(b = bk->head.prev; b != &bk->head; b = b->prev){
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      return b;
+  }
+  return 0;
+}
+
+static void
+bclaim(struct buf *b, uint dev, uint blockno)
+{
+  if(b->flags & B_RA)
+    __sync_fetch_and_add(&bcache.nrawaste, 1);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
 }
 
 // Look through buffer cache for block on device dev.
@@ -65,29 +216,55 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk, *victimbk;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[bhash(dev, blockno)];
+  bucketlock(bk);
+  bk->nlookup++;
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = blookup(bk, dev, blockno)) != 0){
+    bk->nhit++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached; recycle an unused buffer from this bucket.
+  if((b = bvictim(bk)) != 0){
+    bclaim(b, dev, blockno);
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
+  // This bucket is full of busy buffers; steal from another one.
+  // Another CPU may have cached the block while we held no lock,
+  // so look again once we hold both bcache.lock and bk->lock.
+  acquire(&bcache.lock);
+  bucketlock(bk);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  for(victimbk = bcache.bucket; victimbk < bcache.bucket+NBUCKET; victimbk++){
+    if(victimbk == bk)
+      b = bvictim(bk);
+    else {
+      bucketlock(victimbk);
+      if((b = bvictim(victimbk)) != 0){
+        bmovehead(bk, b);
+        bcache.nsteal++;
+      }
+      release(&victimbk->lock);
+    }
+    if(b != 0){
+      bclaim(b, dev, blockno);
+      release(&bk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
@@ -103,12 +280,44 @@ bread(uint dev, uint blockno)
   struct buf *b;
 
   b = bget(dev, blockno);
+  if(b->flags & B_RA){
+    b->flags &= ~B_RA;
+    __sync_fetch_and_add(&bcache.nrahit, 1);
+  }
   if((b->flags & B_VALID) == 0) {
+    __sync_fetch_and_add(&bcache.nsyncread, 1);
     iderw(b);
   }
   return b;
 }
 
+// Start reading the indicated block into the cache and
+// return without waiting.  The disk driver releases the
+// buffer when the read completes; a bread in the meantime
+// waits for it.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->flags |= B_ASYNC | B_RA;
+  __sync_fetch_and_add(&bcache.nraissue, 1);
+  iderw_start(b);
+}
+
+// Called by the disk driver when a B_ASYNC request completes.
+void
+biodone(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  brelse(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -119,29 +328,72 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Start writing b's contents to disk and return at once.
+// Must be locked, and stay locked until biowait(b).
+// Writes queued together can be merged by the disk driver.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  b->flags |= B_DIRTY;
+  iderw_start(b);
+}
+
+// Wait for a bwrite_async(b) to finish.
+void
+biowait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("biowait");
+  iderw_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Move to the head of its bucket's MRU list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b cannot change buckets while we hold a reference.
+  bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bmovehead(bk, b);
   }
+  release(&bk->lock);
+}
 
-  release(&bcache.lock);
+// Print buffer cache and disk statistics to the console.
+// Runs when user types ^B on console.
+// No lock to avoid wedging a stuck machine further.
+void
+bcachedump(void)
+{
+  struct bucket *bk;
+  uint nlookup, nhit, ncontend;
+
+  nlookup = nhit = ncontend = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    nlookup += bk->nlookup;
+    nhit += bk->nhit;
+    ncontend += bk->ncontend;
+  }
+  cprintf("bcache: %d bufs %d buckets: lookup %d hit %d contended %d steal %d\n",
+          bcache.nbuf, NBUCKET, nlookup, nhit, ncontend, bcache.nsteal);
+  cprintf("readahead: issued %d hit %d wasted %d, sync reads %d\n",
+          bcache.nraissue, bcache.nrahit, bcache.nrawaste, bcache.nsyncread);
+  idedump();
+  logdump();
+  icachedump();
+  dcachedump();
+  pcachedump();
 }
-//PAGEBREAK!
-// Blank page.
@@ -3,20 +3,31 @@
 struct buf;
 struct context;
 struct file;
+struct fragstat;
 struct inode;
+struct kmcache;
+struct lockstat;
 struct pipe;
 struct proc;
+struct profsample;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct trapframe;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            biowait(struct buf*);
+void            breadahead(uint, uint);
+void            biodone(struct buf*);
+void            bcachedump(void);
+int             bcachesize(void);
 
 // console.c
 void            consoleinit(void);
@@ -39,10 +50,16 @@ int             filewrite(struct file*, char*, int n);
 // fs.c
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
+void            dcremove(struct inode*, char*);
+void            dcachedump(void);
+void            icachedump(void);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
+void            itext(struct inode*, int);
 void            iinit(int dev);
+void            fsallocinit(int dev);
+void            getfragstat(uint, struct fragstat*);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -54,20 +71,29 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
+int             writeblocks(uint);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderw_start(struct buf*);
+void            iderw_wait(struct buf*);
+void            idedump(void);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
+void            ioapicroute(int irq, int vec, int cpu);
 extern uchar    ioapicid;
 void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+int             kfreepages(void);
+void            kallocdump(void);
+void            kref(char*);
+int             krefcount(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -80,7 +106,9 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(int, int);
 void            lapicstartap(uchar, uint);
+void            lapictimer(int);
 void            microdelay(int);
 
 // log.c
@@ -88,6 +116,11 @@ void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
+void            begin_opn(int);
+void            end_opn(int);
+int             log_opmax(void);
+void            logdump(void);
+void            log_sync(void);
 
 // mp.c
 extern int      ismp;
@@ -97,18 +130,36 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint, uint);
+int             pccached(uint, uint);
+void            pcinval(struct inode*);
+void            pcachedump(void);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
+// profile.c
+void            profinit(void);
+int             proftick(struct trapframe*);
+int             profile(int);
+int             profread(struct profsample*, int);
+
 // proc.c
+int             clone(void(*)(void*, void*), void*, void*, void*);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             futexwait(int*, int);
+int             futexwake(int*, int);
 int             growproc(int);
+int             join(void**);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
@@ -116,9 +167,17 @@ void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedtick(void);
+int             setpriority(int, int);
+int             getpriority(int);
 void            setproc(struct proc*);
+void            setsz(struct proc*, uint);
 void            sleep(void*, struct spinlock*);
+int             threaded(struct proc*);
 void            userinit(void);
+void            vmlock(struct proc*);
+int             vmpinned(struct proc*, uint, uint);
+void            vmunlock(struct proc*);
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
@@ -126,14 +185,23 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// slab.c
+void            slabinit(void);
+void            kmcinit(struct kmcache*, char*, uint);
+void*           kmcalloc(struct kmcache*);
+void            kmcfree(struct kmcache*, void*);
+void            kmcdump(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            droplock(struct spinlock*);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
+int             getlockstat(struct lockstat*, int, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -153,11 +221,15 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argwptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
 
+// ucopy.S
+int             ucopy(void*, void*, uint);
+
 // timer.c
 void            timerinit(void);
 
@@ -177,16 +249,28 @@ void            seginit(void);
 void            kvmalloc(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
+char*           uva2kaw(pde_t*, uint);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(struct proc*);
+int             cowcopy(pde_t*, uint);
+int             vmfault(struct proc*, uint, int);
+int             vmprefault(struct proc*, uint, uint, int);
+int             vmarange(struct proc*, uint, uint);
+uint            vmalimit(struct proc*);
+int             vmamap(struct proc*, uint, int, struct inode*, uint, uint);
+int             vmaunmap(struct proc*, uint, uint);
+int             vmacopy(pde_t*, struct proc*);
+void            vmadup(struct proc*, struct proc*);
+void            vmaclear(struct proc*);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+void            tlbflush(pde_t*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,76 @@
+// Big-file disk throughput.
+//
+//   diskbench [kb]
+//
+// Writes a file of kb kilobytes (default 4096) sequentially and
+// fsyncs it, then reads it back, and prints the ticks each took.
+// The default is several times the block cache, so that the
+// reads go to the disk.  Build with DISK=IDE and DISK=VIRTIO to
+// compare the drivers.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define FILE   "diskbench.file"
+#define CHUNK  8192
+
+char buf[CHUNK];
+
+void
+report(char *what, int kb, int ticks)
+{
+  if(ticks == 0)
+    ticks = 1;
+  printf(1, "%s: %d KB, %d ticks, %d KB/tick\n", what, kb, ticks, kb/ticks);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, kb, n, i, t0;
+
+  kb = 4096;
+  if(argc > 1)
+    kb = atoi(argv[1]);
+  if(kb < CHUNK/1024){
+    printf(2, "usage: diskbench [kb]\n");
+    exit();
+  }
+  n = kb / (CHUNK/1024);
+  kb = n * (CHUNK/1024);
+
+  unlink(FILE);
+  if((fd = open(FILE, O_CREATE|O_WRONLY)) < 0){
+    printf(2, "diskbench: cannot create %s\n", FILE);
+    exit();
+  }
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    buf[0] = i;
+    if(write(fd, buf, CHUNK) != CHUNK){
+      printf(2, "diskbench: write failed at %d KB\n", i * (CHUNK/1024));
+      exit();
+    }
+  }
+  fsync(fd);
+  report("write", kb, uptime() - t0);
+  close(fd);
+
+  if((fd = open(FILE, O_RDONLY)) < 0){
+    printf(2, "diskbench: cannot open %s\n", FILE);
+    exit();
+  }
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(read(fd, buf, CHUNK) != CHUNK || buf[0] != (char)i){
+      printf(2, "diskbench: read failed at %d KB\n", i * (CHUNK/1024));
+      exit();
+    }
+  }
+  report("read", kb, uptime() - t0);
+  close(fd);
+  unlink(FILE);
+  exit();
+}
@@ -2,23 +2,32 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
 
+// Program segments are not read here: each becomes a VMA
+// that vmfault() pages in from the executable on first touch,
+// sharing pages with other processes running the same file.
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
+  // The other threads would lose their address space.
+  if(threaded(curproc))
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -38,8 +47,10 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map program segments, to be paged in on demand.
   sz = 0;
+  nvma = 0;
+  memset(vma, 0, sizeof(vma));
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -49,12 +60,28 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz >= KERNBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || nvma == NVMA)
       goto bad;
+    if(ph.off + ph.filesz < ph.off)
+      goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = PGROUNDUP(ph.vaddr + ph.memsz);
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    if(ph.flags & ELF_PROG_FLAG_WRITE)
+      vma[nvma].flags = VMA_WRITE;
+    nvma++;
+    sz = ph.vaddr + ph.memsz;
+  }
+  // Each VMA holds a reference to the executable, which
+  // cannot be written while they do.
+  for(i = 0; i < nvma; i++){
+    vma[i].ip = idup(ip);
+    itext(ip, 1);
   }
   iunlockput(ip);
   end_op();
@@ -94,6 +121,11 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  vmaunmap(curproc, 0, KERNBASE);
+  begin_op();
+  vmaclear(curproc);
+  end_op();
+  memmove(curproc->vma, vma, sizeof(vma));
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -109,6 +141,14 @@ exec(char *path, char **argv)
   if(ip){
     iunlockput(ip);
     end_op();
+  } else {
+    begin_op();
+    for(i = 0; i < NVMA; i++)
+      if(vma[i].ip){
+        itext(vma[i].ip, -1);
+        iput(vma[i].ip);
+      }
+    end_op();
   }
   return -1;
 }
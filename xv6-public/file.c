@@ -5,22 +5,29 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "file.h"
 #include "x86.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from a slab cache, so the number of
+// open files is only limited by memory.  ftable.lock protects
+// their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmcinit(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -29,19 +36,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  /* sti(); // homework9 */
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      /* cli(); // homework9 */
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  /* cli();  // homework9 */
-  release(&ftable.lock);
-  return 0;
+  if((f = kmcalloc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -70,9 +69,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmcfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -128,30 +126,32 @@ filewrite(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as much at a time as one FS system call may
+    // reserve of a log transaction, including i-node,
+    // indirect blocks, allocation blocks, and 2 blocks
+    // of slop for non-aligned writes (see writeblocks()).
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512; // 1536 byte
+    int max = log_opmax() * BSIZE;
     int i = 0;
+    while(writeblocks(max) > log_opmax())
+      max -= BSIZE;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(writeblocks(n1));
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(writeblocks(n1));
 
       if(r < 0)
         break;
       if(r != n1)
-        panic("short filewrite");
+        break;  // file reached its maximum size
       i += r;
     }
     return i == n ? n : -1;
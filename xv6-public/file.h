@@ -14,6 +14,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count // c pointer
+  struct inode *next; // icache hash chain
+  struct inode *lrunext; // icache LRU list, while ref == 0
+  struct inode *lruprev;
+  int ntext;          // exec segments mapping it (see itext)
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -23,6 +27,14 @@ struct inode {
   short nlink;        // directory link
   uint size;
   uint addrs[NDIRECT+2];
+
+  uint ranext;        // block after the last one readi returned
+  uint raend;         // block after the last one read ahead
+  uint rawin;         // readahead window in blocks, 0 if not sequential
+  int pcached;        // page cache may hold pages of this file
+  uint lastblk;       // block allocated last, 0 if unknown
+  uint rstart;        // blocks writei set aside: rlen from rstart
+  uint rlen;
 };
 
 // table mapping major device number to
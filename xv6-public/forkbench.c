@@ -0,0 +1,62 @@
+// Measure fork and fork+exec latency.
+// Run it on kernels with and without copy-on-write fork
+// and compare the ticks per 100 iterations.
+// The parent grows a heap first, since eager copying
+// costs grow with the size of the forking process.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define N      200
+#define HEAPSZ (1024*1024)
+
+void
+forkwait(int exec_child)
+{
+  char *argv[] = { "forkbench", "-exit", 0 };
+  int i, pid;
+
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "forkbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      if(exec_child)
+        exec(argv[0], argv);
+      exit();
+    }
+    wait();
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *heap;
+  int i, t0, t1;
+
+  // Child side of the fork+exec loop: nothing to do.
+  if(argc > 1 && strcmp(argv[1], "-exit") == 0)
+    exit();
+
+  heap = sbrk(HEAPSZ);
+  for(i = 0; i < HEAPSZ; i += 4096)
+    heap[i] = i;
+
+  t0 = uptime();
+  forkwait(0);
+  t1 = uptime();
+  printf(1, "fork+exit: %d iterations, %d ticks (%d ticks/100)\n",
+         N, t1-t0, (t1-t0)*100/N);
+
+  t0 = uptime();
+  forkwait(1);
+  t1 = uptime();
+  printf(1, "fork+exec: %d iterations, %d ticks (%d ticks/100)\n",
+         N, t1-t0, (t1-t0)*100/N);
+
+  exit();
+}
@@ -0,0 +1,17 @@
+// File system fragmentation statistics (see fragstat()).
+#define FRAGNGROUP 16   // groups reported
+
+struct fragstat {
+  uint nblocks;           // data blocks
+  uint nfree;             // ... free
+  uint nfreerun;          // runs of free blocks
+  uint maxfreerun;        // longest run
+  uint ninodes;
+  uint nfreeinode;
+  uint nfile;             // files and directories with blocks
+  uint nfileblock;        // their data blocks
+  uint nfilerun;          // runs of consecutive blocks in them
+  uint nfragged;          // files in more than one run
+  uint ngroup;            // groups of blocks, one per bitmap block
+  uint groupfree[FRAGNGROUP];  // free blocks per group
+};
@@ -14,15 +14,20 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
 #include "file.h"
+#include "fragstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static uint bmapext(struct inode*, uint);
+static void dcinit(void);
+static void dcpurge(uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb;
@@ -38,6 +43,69 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+// Blocks.
+//
+// The free bitmap is summarized in memory by fsalloc: the number
+// of free blocks under each bitmap block (a group of BPB blocks)
+// and of free inodes in each inode block, so that allocation
+// skips full groups and inode blocks without reading them.
+// fsallocinit counts them once the log has been recovered.
+//
+// Blocks are allocated next-fit from a goal.  A file's blocks
+// go right after the last one it got (ip->lastblk); its first
+// goes where the last allocation in the group that matches its
+// inode number ended, so that files made together, which get
+// nearby inode numbers (see ialloc), are also near each other
+// on disk.  writei takes the blocks an append needs as one
+// contiguous run.
+
+static struct {
+  struct spinlock lock;
+  uint ngroup;
+  uint gfree[FSSIZE/BPB + 1];  // free blocks per group
+  uint gnext[FSSIZE/BPB + 1];  // next-fit cursor per group
+  uchar *ifree;         // free inodes per inode block
+} fsalloc;
+
+// Count free blocks and inodes.
+void
+fsallocinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint b, bi, n, inum;
+
+  initlock(&fsalloc.lock, "fsalloc");
+  if(sb.size > FSSIZE || (sb.ninodes + IPB-1)/IPB > PGSIZE)
+    panic("fsallocinit: file system too big");
+  if((fsalloc.ifree = (uchar*)kalloc()) == 0)
+    panic("fsallocinit: out of memory");
+
+  fsalloc.ngroup = (sb.size + BPB-1) / BPB;
+  for(b = 0; b < sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, sb));
+    n = 0;
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        n++;
+    brelse(bp);
+    fsalloc.gfree[b/BPB] = n;
+    fsalloc.gnext[b/BPB] = b;
+  }
+
+  for(inum = 0; inum < sb.ninodes; inum += IPB){
+    bp = bread(dev, IBLOCK(inum, sb));
+    n = 0;
+    for(bi = 0; bi < IPB && inum + bi < sb.ninodes; bi++){
+      dip = (struct dinode*)bp->data + bi;
+      if(inum + bi > 0 && dip->type == 0)
+        n++;
+    }
+    brelse(bp);
+    fsalloc.ifree[inum/IPB] = n;
+  }
+}
+
 // Zero a block.
 static void
 bzero(int dev, int bno)
@@ -50,33 +118,66 @@ bzero(int dev, int bno)
   brelse(bp);
 }
 
-// Blocks.
-
-// Allocate a zeroed disk block.
+// Allocate up to want zeroed blocks in a row, starting with the
+// first free block at or after goal (wrapping around to the
+// start of the disk), and set *n to how many.  Returns the first.
 static uint
-balloc(uint dev)
+ballocrun(uint dev, uint goal, uint want, uint *n)
 {
-  int b, bi, m;
   struct buf *bp;
-
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  uint i, g, b, bi, first;
+
+  if(goal >= sb.size)
+    goal = 0;
+  if(goal < sb.size - sb.nblocks)
+    goal = sb.size - sb.nblocks;
+  // The goal's group comes up twice, to look below the goal.
+  for(i = 0; i <= fsalloc.ngroup; i++){
+    g = (goal/BPB + i) % fsalloc.ngroup;
+    if(fsalloc.gfree[g] == 0)
+      continue;
+    b = g * BPB;
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+    for(bi = (i == 0 ? goal%BPB : 0); bi < BPB && b + bi < sb.size; bi++){
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+        bi += 7;
+        continue;
       }
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)  // Is block free?
+        break;
+    }
+    if(bi == BPB || b + bi >= sb.size){
+      brelse(bp);
+      continue;
     }
+    first = b + bi;
+    for(*n = 0; *n < want && bi < BPB && b + bi < sb.size &&
+          (bp->data[bi/8] & (1 << (bi % 8))) == 0; bi++, (*n)++)
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+    log_write(bp);
     brelse(bp);
+
+    acquire(&fsalloc.lock);
+    fsalloc.gfree[g] -= *n;
+    fsalloc.gnext[g] = first + *n;
+    release(&fsalloc.lock);
+    for(b = first; b < first + *n; b++)
+      bzero(dev, b);
+    return first;
   }
   panic("balloc: out of blocks");
 }
 
+// Allocate a zeroed disk block, the first free one
+// at or after goal.
+static uint
+ballocnear(uint dev, uint goal)
+{
+  uint n;
+
+  return ballocrun(dev, goal, 1, &n);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -84,7 +185,6 @@ bfree(int dev, uint b)
   struct buf *bp;
   int bi, m;
 
-  readsb(dev, &sb);
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
@@ -93,6 +193,123 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+
+  acquire(&fsalloc.lock);
+  fsalloc.gfree[b/BPB]++;
+  release(&fsalloc.lock);
+}
+
+// Count data block b of a file for fragstat: a new run
+// unless it follows *last, the file's block before it.
+static void
+fragblock(struct fragstat *st, uint *last, uint b)
+{
+  st->nfileblock++;
+  if(b != *last + 1)
+    st->nfilerun++;
+  *last = b;
+}
+
+// Count the data blocks under indirect block addr, which
+// has depth levels of indirection.
+static void
+fragind(uint dev, struct fragstat *st, uint *last, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int i;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(i = 0; i < NINDIRECT; i++){
+    if(a[i] == 0)
+      continue;
+    if(depth > 1)
+      fragind(dev, st, last, a[i], depth - 1);
+    else
+      fragblock(st, last, a[i]);
+  }
+  brelse(bp);
+}
+
+// Fill in fragmentation statistics from the free bitmap and
+// every inode's block map.  Reads them without locking inodes,
+// so the numbers are approximate while files change.
+void
+getfragstat(uint dev, struct fragstat *st)
+{
+  struct buf *bp;
+  struct dinode di;
+  struct extent *ex;
+  uint b, run, inum, last, nrun, i, j;
+
+  memset(st, 0, sizeof(*st));
+  st->nblocks = sb.nblocks;
+  st->ninodes = sb.ninodes;
+  st->ngroup = fsalloc.ngroup;
+  for(i = 0; i < fsalloc.ngroup && i < FRAGNGROUP; i++)
+    st->groupfree[i] = fsalloc.gfree[i];
+
+  bp = 0;
+  run = 0;
+  for(b = sb.size - sb.nblocks; b < sb.size; b++){
+    if(bp == 0 || b % BPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    if((bp->data[(b%BPB)/8] & (1 << (b % 8))) == 0){
+      st->nfree++;
+      if(run++ == 0)
+        st->nfreerun++;
+      if(run > st->maxfreerun)
+        st->maxfreerun = run;
+    } else
+      run = 0;
+  }
+  if(bp)
+    brelse(bp);
+
+  for(inum = 1; inum < sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, sb));
+    di = *((struct dinode*)bp->data + inum%IPB);
+    brelse(bp);
+    if(di.type == 0){
+      st->nfreeinode++;
+      continue;
+    }
+    if(di.type == T_DEV)
+      continue;
+
+    nrun = st->nfilerun;
+    last = 0;
+    if(sb.flags & FS_EXTENT){
+      ex = (struct extent*)di.addrs;
+      for(i = 0; i < NEXTENT && ex[i].len > 0; i++)
+        for(j = 0; j < ex[i].len; j++)
+          fragblock(st, &last, ex[i].start + j);
+      if(i == NEXTENT && di.addrs[NDIRECT+1]){
+        bp = bread(dev, di.addrs[NDIRECT+1]);
+        ex = (struct extent*)bp->data;
+        for(i = 0; i < NXEXTENT && ex[i].len > 0; i++)
+          for(j = 0; j < ex[i].len; j++)
+            fragblock(st, &last, ex[i].start + j);
+        brelse(bp);
+      }
+    } else {
+      for(i = 0; i < NDIRECT; i++)
+        if(di.addrs[i])
+          fragblock(st, &last, di.addrs[i]);
+      if(di.addrs[NDIRECT])
+        fragind(dev, st, &last, di.addrs[NDIRECT], 1);
+      if(di.addrs[NDIRECT+1])
+        fragind(dev, st, &last, di.addrs[NDIRECT+1], 2);
+    }
+    if(st->nfilerun > nrun)
+      st->nfile++;
+    if(st->nfilerun > nrun + 1)
+      st->nfragged++;
+  }
 }
 
 // Inodes.
@@ -120,18 +337,22 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to a cache entry (open files and
+//   current directories). iget() finds or creates a cache
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref falls to zero stays cached, on an
+//   LRU list, so that opening the file again needs no disk
+//   read; past NINODELRU such entries the least recently
+//   used is freed.  Entries come from a slab cache, so there
+//   is no fixed limit on the number of inodes in use.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk if ip->valid is
+//   0 and sets it; it stays set while the entry is cached,
+//   since the cache is write-through.  iput() clears it when
+//   it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -155,8 +376,9 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
+// The icache.lock spin-lock protects the hash chains and the
+// LRU list of icache entries. Since ip->ref decides when an
+// entry is freed,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
 //
@@ -166,18 +388,60 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];  // all entries, through ip->next
+  struct inode *lru;    // entries with ref 0, most recent first
+  struct inode *lrutail;
+  int nlru;
+  struct kmcache cache;
+
+  // Statistics.
+  uint nget;            // iget calls
+  uint nhit;            // ... that found the inode cached
+  uint nread;           // inodes read from disk by ilock
+  uint nevict;          // unreferenced entries freed
 } icache;
 
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &icache.hash[(dev * 31 + inum) % NIHASH];
+}
+
+// Take ip off the LRU list.  Caller holds icache.lock.
+static void
+lruremove(struct inode *ip)
+{
+  if(ip->lruprev)
+    ip->lruprev->lrunext = ip->lrunext;
+  else
+    icache.lru = ip->lrunext;
+  if(ip->lrunext)
+    ip->lrunext->lruprev = ip->lruprev;
+  else
+    icache.lrutail = ip->lruprev;
+  icache.nlru--;
+}
+
+// Take ip out of the cache and free it.  Caller holds
+// icache.lock; ip->ref is 0 and ip is not on the LRU list.
+static void
+ifree(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  droplock(&ip->lock.lk);
+  kmcfree(&icache.cache, ip);
+}
+
 void
 iinit(int dev)
 {
-  int i = 0;
-
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  kmcinit(&icache.cache, "inode", sizeof(struct inode));
+  dcinit();
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
@@ -191,23 +455,48 @@ static struct inode* iget(uint dev, uint inum);
 //PAGEBREAK!
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// A file gets the first free inode after near, its directory,
+// so that its blocks go near the directory's (see igoal); a
+// directory starts a new cluster, in the group with the most
+// free blocks.
 // Returns an unlocked but allocated and referenced inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint i, g, best, nblk, blk, inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  if(type == T_DIR){
+    best = 0;
+    for(g = 1; g < fsalloc.ngroup; g++)
+      if(fsalloc.gfree[g] > fsalloc.gfree[best])
+        best = g;
+    near = (best * sb.ninodes + fsalloc.ngroup-1) / fsalloc.ngroup;
+  }
+  if(near >= sb.ninodes)
+    near = 1;
+
+  // The first inode block comes up twice, to look below near.
+  nblk = (sb.ninodes + IPB-1) / IPB;
+  for(i = 0; i <= nblk; i++){
+    blk = (near/IPB + i) % nblk;
+    if(fsalloc.ifree[blk] == 0)
+      continue;
+    bp = bread(dev, IBLOCK(blk*IPB, sb));
+    for(inum = blk*IPB + (i == 0 ? near%IPB : 0);
+        inum < (blk+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum > 0 && dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+        brelse(bp);
+        acquire(&fsalloc.lock);
+        fsalloc.ifree[blk]--;
+        release(&fsalloc.lock);
+        return iget(dev, inum);
+      }
     }
     brelse(bp);
   }
@@ -242,31 +531,33 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **hp;
 
   acquire(&icache.lock);
+  icache.nget++;
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  hp = ihash(dev, inum);
+  for(ip = *hp; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruremove(ip);
+      icache.nhit++;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Make a new inode cache entry.
+  if((ip = kmcalloc(&icache.cache)) == 0)
+    panic("iget: out of memory");
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
-  ip->valid = 0;
+  ip->next = *hp;
+  *hp = ip;
   release(&icache.lock);
 
   return ip;
@@ -283,6 +574,19 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Count n more (or, if n < 0, fewer) exec segments mapping ip.
+// While there are any, writei refuses to change the file, so
+// that demand paging keeps loading the program that was
+// exec'ed.  The count rises from 0 only in exec, which holds
+// ip->lock, so it cannot do so during a writei.
+void
+itext(struct inode *ip, int n)
+{
+  acquire(&icache.lock);
+  ip->ntext += n;
+  release(&icache.lock);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -306,7 +610,9 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->pcached = pccached(ip->dev, ip->inum);
     ip->valid = 1;
+    __sync_fetch_and_add(&icache.nread, 1);
     if(ip->type == 0)
       panic("ilock: no type");
   }
@@ -323,8 +629,9 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry goes
+// on the LRU list, or is freed if it does not hold a valid
+// inode.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -339,19 +646,52 @@ iput(struct inode *ip)
     release(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcpurge(ip->dev, ip->inum);
+      if(ip->pcached)
+        pcinval(ip);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      acquire(&fsalloc.lock);
+      fsalloc.ifree[ip->inum/IPB]++;
+      release(&fsalloc.lock);
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0){
+    if(!ip->valid)
+      ifree(ip);
+    else {
+      ip->lruprev = 0;
+      ip->lrunext = icache.lru;
+      if(icache.lru)
+        icache.lru->lruprev = ip;
+      else
+        icache.lrutail = ip;
+      icache.lru = ip;
+      if(++icache.nlru > NINODELRU){
+        ip = icache.lrutail;
+        lruremove(ip);
+        ifree(ip);
+        icache.nevict++;
+      }
+    }
+  }
   release(&icache.lock);
 }
 
+// Print inode cache statistics.  No lock, like bcachedump.
+void
+icachedump(void)
+{
+  cprintf("icache: %d unused cached: iget %d hit %d, read %d, evict %d\n",
+          icache.nlru, icache.nget, icache.nhit, icache.nread, icache.nevict);
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -366,7 +706,37 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], and the DNINDIRECT
+// after that through the doubly-indirect ip->addrs[NDIRECT+1].
+// On FS_EXTENT file systems ip->addrs[] holds extents instead
+// (see fs.h), so a contiguous file needs no indirect blocks.
+
+// Where ip's next block should go: after the last one it got
+// (writei finds that for a file just read from disk), else at
+// its inode's group's cursor.  Caller must hold ip->lock.
+static uint
+igoal(struct inode *ip)
+{
+  if(ip->lastblk)
+    return ip->lastblk + 1;
+  return fsalloc.gnext[ip->inum * fsalloc.ngroup / sb.ninodes];
+}
+
+// Allocate a data block for ip, from the run writei set aside
+// if there is one.
+static uint
+bmapalloc(struct inode *ip)
+{
+  uint addr;
+
+  if(ip->rlen > 0){
+    addr = ip->rstart++;
+    ip->rlen--;
+  } else
+    addr = ballocnear(ip->dev, igoal(ip));
+  ip->lastblk = addr;
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -376,9 +746,12 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if(sb.flags & FS_EXTENT)
+    return bmapext(ip, bn);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bmapalloc(ip);
     return addr;
   }
 
@@ -386,11 +759,11 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = ballocnear(ip->dev, igoal(ip));
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = bmapalloc(ip);
       log_write(bp);
     }
     brelse(bp);
@@ -402,13 +775,13 @@ bmap(struct inode *ip, uint bn)
   if(bn < DNINDIRECT) {
     // Load first indirect block, allocating if necessary
     if((addr = ip->addrs[NDIRECT+1]) == 0) {
-      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT+1] = addr = ballocnear(ip->dev, igoal(ip));
     }
 
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn/NINDIRECT]) == 0) {
-      a[bn/NINDIRECT] = addr = balloc(ip->dev);
+      a[bn/NINDIRECT] = addr = ballocnear(ip->dev, igoal(ip));
       log_write(bp);
     }
     brelse(bp);
@@ -416,7 +789,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn%NINDIRECT]) == 0) {
-      a[bn%NINDIRECT] = addr = balloc(ip->dev);
+      a[bn%NINDIRECT] = addr = bmapalloc(ip);
       log_write(bp);
     }
     brelse(bp);
@@ -427,6 +800,101 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// bmap() for FS_EXTENT file systems.  Blocks can only be
+// added at the end of the file; a new block extends the last
+// extent if the block after it is free.  Returns 0 if bn
+// would need more than NEXTENT+NXEXTENT extents.
+static uint
+bmapext(struct inode *ip, uint bn)
+{
+  struct extent *ex, *last;
+  struct buf *bp;
+  uint base, addr;
+  int i;
+
+  bp = 0;
+  ex = last = 0;
+  base = 0;
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if(i < NEXTENT)
+      ex = (struct extent*)ip->addrs + i;
+    else {
+      if(bp == 0){
+        // Load extent block, allocating if necessary.
+        if(ip->addrs[NDIRECT+1] == 0)
+          ip->addrs[NDIRECT+1] = ballocnear(ip->dev, igoal(ip));
+        bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+      }
+      ex = (struct extent*)bp->data + (i - NEXTENT);
+    }
+    if(ex->len == 0)
+      break;
+    if(bn < base + ex->len){
+      addr = ex->start + (bn - base);
+      goto out;
+    }
+    base += ex->len;
+    last = ex;
+  }
+
+  if(bn != base)
+    panic("bmapext: hole");
+  addr = 0;
+  if(i == NEXTENT + NXEXTENT)
+    goto out;
+  addr = bmapalloc(ip);
+  if(last && addr == last->start + last->len){
+    last->len++;
+    ex = last;
+  }
+  if(ex != last){
+    ex->start = addr;
+    ex->len = 1;
+  }
+  if(bp && (uchar*)ex >= bp->data && (uchar*)ex < bp->data + BSIZE)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// Free the blocks of extent ex.
+static void
+efree(uint dev, struct extent *ex)
+{
+  uint b;
+
+  for(b = ex->start; b < ex->start + ex->len; b++)
+    bfree(dev, b);
+  ex->start = 0;
+  ex->len = 0;
+}
+
+// itrunc() for FS_EXTENT file systems.
+static void
+itruncext(struct inode *ip)
+{
+  int i;
+  struct buf *bp;
+  struct extent *ex;
+
+  ex = (struct extent*)ip->addrs;
+  for(i = 0; i < NEXTENT; i++)
+    efree(ip->dev, &ex[i]);
+
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+    ex = (struct extent*)bp->data;
+    for(i = 0; i < NXEXTENT; i++)
+      efree(ip->dev, &ex[i]);
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -439,6 +907,13 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(sb.flags & FS_EXTENT){
+    itruncext(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -501,6 +976,34 @@ stati(struct inode *ip, struct stat *st)
 }
 
 //PAGEBREAK!
+// Sequential readahead for a readi of blocks first..last.
+// A read that starts where the previous one ended (or in the
+// same block) continues a sequential run.  Once the reader gets
+// within half a window of the blocks already read ahead, the
+// window doubles, up to RAMAX, and the blocks up to a window past
+// last are queued without waiting, so the disk works on them
+// while the reader consumes the ones it has.  Any other read
+// turns readahead off until the next sequential run.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, nblock;
+
+  if(first != ip->ranext && first + 1 != ip->ranext){
+    ip->rawin = 0;
+    ip->raend = 0;
+  } else if(ip->raend <= last + 1 + ip->rawin/2){
+    ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+    nblock = (ip->size + BSIZE - 1) / BSIZE;
+    end = min(last + 1 + ip->rawin, nblock);
+    for(bn = (ip->raend > last ? ip->raend : last + 1); bn < end; bn++)
+      breadahead(ip->dev, bmap(ip, bn));
+    if(end > ip->raend)
+      ip->raend = end;
+  }
+  ip->ranext = last + 1;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 int
@@ -519,6 +1022,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off/BSIZE, (off + n - 1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -529,13 +1034,31 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   return n;
 }
 
+// Most blocks writei may log for a write of n bytes: the data
+// blocks, two of them partly written, the indirect or extent
+// blocks over them, the bitmap blocks for new ones, and the
+// inode.  What a write must reserve with begin_opn().
+int
+writeblocks(uint n)
+{
+  uint nb;
+
+  nb = n/BSIZE + 2;
+  // Indirect blocks: one per NINDIRECT data blocks, plus 3.
+  // A run in the doubly-indirect range can touch the root and a
+  // partly covered second-level block at each end; one that
+  // crosses into it from the singly-indirect range touches the
+  // singly-indirect block, the root and a partial block.
+  return nb + (nb/NINDIRECT + 3) + (nb/BPB + 2) + 1;
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, need;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -546,22 +1069,42 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(n == 0)
+    return 0;
+  if((off + n - 1)/BSIZE >= MAXFILE)
     return -1;
+  if(ip->ntext > 0)
+    return -1;  // a running program's text (see itext)
+  if(ip->pcached)
+    pcinval(ip);
+
+  // Set aside, in one piece if possible, the blocks this write
+  // adds after the end of the file.
+  if(ip->lastblk == 0 && ip->size > 0)
+    ip->lastblk = bmap(ip, (ip->size - 1) / BSIZE);
+  need = (off + n + BSIZE-1)/BSIZE - (ip->size + BSIZE-1)/BSIZE;
+  if((int)need > 1)
+    ip->rstart = ballocrun(ip->dev, igoal(ip), need, &ip->rlen);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;  // out of extents
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
     log_write(bp);
     brelse(bp);
   }
 
-  if(n > 0 && off > ip->size){
+  // Return what went unused.
+  for(; ip->rlen > 0; ip->rlen--)
+    bfree(ip->dev, ip->rstart++);
+
+  if(tot > 0 && off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return tot;
 }
 
 //PAGEBREAK!
@@ -573,8 +1116,162 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name cache.
+//
+// Remembers the results of dirlookup, keyed by (dev, directory
+// inum, name), so that namex can resolve a cached path element
+// without locking the directory or reading its blocks.  An entry
+// with inum 0 is negative: the name is known to be absent.
+//
+// Entries are only added and changed while the directory's sleep
+// lock is held (by dirlookup, dirlink and dcenter's callers), so
+// they always agree with the directory's contents.  dcpurge drops
+// a directory's entries when its inode is freed, since the inum
+// may be reused.  dclookup takes its inode reference under
+// dcache.lock, so an entry cannot be unlinked and its inode freed
+// between finding the entry and taking the reference.
+//
+// The cache is split into NDCACHE/DCWAYS hash sets of DCWAYS
+// entries; a full set replaces its least recently used entry.
+
+struct dcentry {
+  uint dev;
+  uint dinum;       // directory; 0 if the entry is unused
+  uint inum;        // inode named, or 0 if name is absent
+  char name[DIRSIZ];
+  uint lastuse;     // dcache.clock at last use
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct dcentry entry[NDCACHE];
+
+  // Statistics, protected by lock.
+  uint nhit;
+  uint nneg;        // hits on negative entries
+  uint nmiss;
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dcentry*
+dcset(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev*31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return &dcache.entry[(h % (NDCACHE/DCWAYS)) * DCWAYS];
+}
+
+// Find the entry for (dev, dinum, name).  Caller holds dcache.lock.
+static struct dcentry*
+dcfind(uint dev, uint dinum, char *name)
+{
+  struct dcentry *e, *set;
+
+  set = dcset(dev, dinum, name);
+  for(e = set; e < set + DCWAYS; e++)
+    if(e->dinum == dinum && e->dev == dev && namecmp(e->name, name) == 0)
+      return e;
+  return 0;
+}
+
+// Look up name in directory dp without locking dp.
+// Returns 1 and a referenced inode in *ipp if the name is cached,
+// -1 if it is cached as absent, and 0 if it is not cached.
+static int
+dclookup(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dcentry *e;
+  int r;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dp->dev, dp->inum, name)) == 0){
+    dcache.nmiss++;
+    r = 0;
+  } else if(e->inum == 0){
+    e->lastuse = ++dcache.clock;
+    dcache.nneg++;
+    r = -1;
+  } else {
+    e->lastuse = ++dcache.clock;
+    dcache.nhit++;
+    *ipp = iget(dp->dev, e->inum);
+    r = 1;
+  }
+  release(&dcache.lock);
+  return r;
+}
+
+// Record that name in directory dp refers to inum
+// (0 if absent).  Caller must hold dp->lock.
+static void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dcentry *e, *x, *set;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dp->dev, dp->inum, name)) == 0){
+    // Take an unused entry, or else the least recently used.
+    set = dcset(dp->dev, dp->inum, name);
+    e = set;
+    for(x = set; x < set + DCWAYS; x++){
+      if(x->dinum == 0){
+        e = x;
+        break;
+      }
+      if(x->lastuse < e->lastuse)
+        e = x;
+    }
+    e->dev = dp->dev;
+    e->dinum = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+  }
+  e->inum = inum;
+  e->lastuse = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Record that name has been removed from directory dp,
+// which must be locked.
+void
+dcremove(struct inode *dp, char *name)
+{
+  dcenter(dp, name, 0);
+}
+
+// Drop all entries for directory (dev, dinum).
+static void
+dcpurge(uint dev, uint dinum)
+{
+  struct dcentry *e;
+
+  acquire(&dcache.lock);
+  for(e = dcache.entry; e < &dcache.entry[NDCACHE]; e++)
+    if(e->dinum == dinum && e->dev == dev)
+      e->dinum = 0;
+  release(&dcache.lock);
+}
+
+// Print name cache statistics.  No lock, like bcachedump.
+void
+dcachedump(void)
+{
+  cprintf("dcache: %d entries: hit %d negative %d miss %d\n",
+          NDCACHE, dcache.nhit, dcache.nneg, dcache.nmiss);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// The result, found or not, goes in the name cache.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -594,10 +1291,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcenter(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcenter(dp, name, 0);
   return 0;
 }
 
@@ -627,6 +1326,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp, name, inum);
 
   return 0;
 }
@@ -679,13 +1379,28 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  struct proc *g;
+  int r;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    g = myproc()->group;
+    acquire(&g->glock);  // a sibling thread may chdir
+    ip = idup(g->cwd);
+    release(&g->glock);
+  }
 
   while((path = skipelem(path, name)) != 0){
+    // Cached names need no directory lock.  An entry exists
+    // only for a directory, so ip->type need not be checked.
+    if(!(nameiparent && *path == '\0') && (r = dclookup(ip, name, &next)) != 0){
+      iput(ip);
+      if(r < 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     // ilock有强制载入ip的额外功能
     ilock(ip);
     if(ip->type != T_DIR){
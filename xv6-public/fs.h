@@ -3,7 +3,9 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#ifndef BSIZE
+#define BSIZE 512  // block size; the Makefile may pick 4096
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -19,8 +21,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_* flags chosen by mkfs
 };
 
+#define FS_EXTENT 0x1  // inodes map their data with extents
+
+// Header blocks of a log region holding n blocks: a count and
+// a sequence number, then the n block numbers.
+#define LOGHDRBLOCKS(n) ((2*sizeof(uint) + (n)*sizeof(uint) + BSIZE-1) / BSIZE)
+
 #define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define DNINDIRECT (NINDIRECT*NINDIRECT)
@@ -36,6 +45,18 @@ struct dinode {
   uint addrs[NDIRECT+2];   // Data block addresses
 };
 
+// On FS_EXTENT file systems, addrs[] instead holds NEXTENT
+// extents, each a run of len consecutive disk blocks starting at
+// start, mapping the file's blocks in order.  addrs[NDIRECT+1] is
+// then the block number of an extent block holding NXEXTENT more.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NEXTENT ((NDIRECT+1)/2)
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
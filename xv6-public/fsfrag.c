@@ -0,0 +1,39 @@
+// Print how fragmented the file system is.
+//
+//   fsfrag
+//
+// Free space: free blocks, the runs they form and the longest
+// run, and free blocks per group (bitmap block).  Files: blocks
+// in use by files and directories, the runs of consecutive
+// blocks they form, and how many files are in more than one.
+// Fewer runs per file means more sequential disk access.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fragstat.h"
+
+int
+main(void)
+{
+  struct fragstat st;
+  int i;
+
+  if(fragstat(&st) < 0){
+    printf(2, "fsfrag: failed\n");
+    exit();
+  }
+  printf(1, "blocks: %d data, %d free in %d runs, longest run %d\n",
+         st.nblocks, st.nfree, st.nfreerun, st.maxfreerun);
+  printf(1, "inodes: %d, %d free\n", st.ninodes, st.nfreeinode);
+  printf(1, "files: %d with %d blocks in %d runs, %d in more than one run\n",
+         st.nfile, st.nfileblock, st.nfilerun, st.nfragged);
+  if(st.nfile > 0)
+    printf(1, "runs per file: %d.%d\n", st.nfilerun / st.nfile,
+           st.nfilerun * 10 / st.nfile % 10);
+  printf(1, "free per group:");
+  for(i = 0; i < st.ngroup && i < FRAGNGROUP; i++)
+    printf(1, " %d", st.groupfree[i]);
+  printf(1, "\n");
+  exit();
+}
@@ -1,14 +1,16 @@
 // Simple PIO-based (non-DMA) IDE driver code.
+// Requests for adjacent blocks are merged into one
+// READ/WRITE MULTIPLE command.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -23,16 +25,29 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+#define IDE_MAXSECT   16   // most sectors merged into one command
+
+// idequeue points to the first buf of the batch now being
+// read/written to the disk; the batch is the first idebatch bufs.
+// The rest of the queue is kept in elevator (C-SCAN) order
+// starting from idepos, so that idestart() finds blocks that are
+// adjacent on disk next to each other and can merge them into a
+// single multi-sector command of up to IDE_MAXSECT sectors.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idebatch;
+static uint idepos;
 
 static int havedisk1;
-static void idestart(struct buf*);
+static void idestart(void);
+
+// Statistics, protected by idelock.
+static uint nidecmd;    // commands issued
+static uint nidebuf;    // bufs transferred
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,6 +62,19 @@ idewait(int checkerr)
   return 0;
 }
 
+// Have the drive transfer up to IDE_MAXSECT sectors per
+// interrupt for READ/WRITE MULTIPLE.
+static void
+idesetmult(int dev)
+{
+  outb(0x1f6, 0xe0 | (dev<<4));
+  idewait(0);
+  outb(0x3f6, 2);  // no interrupt for this one
+  outb(0x1f2, IDE_MAXSECT);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  idewait(0);
+}
+
 void
 ideinit(void)
 {
@@ -65,37 +93,70 @@ ideinit(void)
     }
   }
 
+  if(havedisk1)
+    idesetmult(1);
+  idesetmult(0);
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Can b be transferred by the same command as prev, right after it?
+static int
+idemergeable(struct buf *prev, struct buf *b)
+{
+  return b->dev == prev->dev &&
+    b->blockno == prev->blockno + 1 &&
+    (b->flags & B_DIRTY) == (prev->flags & B_DIRTY);
+}
+
+// Start the request at the head of idequeue, merged with the bufs
+// behind it that continue it on disk.  Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(void)
 {
-  if(b == 0)
+  struct buf *b, *last;
+  int sector_per_block =  BSIZE/SECTOR_SIZE;
+  int nsect, sector;
+
+  if((b = idequeue) == 0)
     panic("idestart");
   if(b->blockno >= FSSIZE)
     panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  if(sector_per_block > IDE_MAXSECT)
+    panic("idestart");
 
-  if (sector_per_block > 7) panic("idestart");
+  // Collect the batch.
+  idebatch = 1;
+  nsect = sector_per_block;
+  for(last = b; last->qnext && nsect + sector_per_block <= IDE_MAXSECT &&
+        idemergeable(last, last->qnext); last = last->qnext){
+    if(last->qnext->blockno >= FSSIZE)
+      panic("incorrect blockno");
+    idebatch++;
+    nsect += sector_per_block;
+  }
+  idepos = b->blockno;
+  nidecmd++;
+  nidebuf += idebatch;
 
+  sector = b->blockno * sector_per_block;
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nsect);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    outb(0x1f7, nsect == 1 ? IDE_CMD_WRITE : IDE_CMD_WRMUL);
+    for(; ; b = b->qnext){
+      outsl(0x1f0, b->data, BSIZE/4);
+      if(b == last)
+        break;
+    }
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, nsect == 1 ? IDE_CMD_READ : IDE_CMD_RDMUL);
   }
 }
 
@@ -103,41 +164,61 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *done;
+  int i, ok;
 
-  // First queued buffer is the active request.
+  // The first idebatch queued buffers are the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(idequeue == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  ok = (idequeue->flags & B_DIRTY) || idewait(1) >= 0;
+  done = 0;
+  for(i = 0; i < idebatch; i++){
+    b = idequeue;
+    idequeue = b->qnext;
+
+    // Read data if needed.
+    if(!(b->flags & B_DIRTY) && ok)
+      insl(0x1f0, b->data, BSIZE/4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+    // Wake process waiting for this buf.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->qnext = done;
+      done = b;
+    } else
+      wakeup(b);
+  }
+  idebatch = 0;
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
-    idestart(idequeue);
+    idestart();
 
   release(&idelock);
+
+  // Release buffers nobody is waiting for, outside idelock.
+  while((b = done) != 0){
+    done = b->qnext;
+    biodone(b);
+  }
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
+// Queue b for the disk and return without waiting.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// The caller must keep b locked until iderw_wait(b) returns.
 void
-iderw(struct buf *b)
+iderw_start(struct buf *b)
 {
   struct buf **pp;
+  int i;
 
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
@@ -147,23 +228,49 @@ iderw(struct buf *b)
     panic("iderw: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
-  /* sti(); // homework9 */
 
-  // Append b to idequeue.
+  // Insert b in elevator order, behind the active batch.
   b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
+  pp = &idequeue;
+  for(i = 0; i < idebatch; i++)
+    pp = &(*pp)->qnext;
+  for(; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+    if((*pp)->blockno - idepos > b->blockno - idepos)
+      break;
+  b->qnext = *pp;
   *pp = b;
 
   // Start disk if necessary.
   if(idequeue == b)
-    idestart(b);
+    idestart();
+
+  release(&idelock);
+}
 
-  // Wait for request to finish.
+// Wait for a request queued by iderw_start to finish.
+void
+iderw_wait(struct buf *b)
+{
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
-  /* cli(); // homework9 */
   release(&idelock);
 }
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  iderw_start(b);
+  iderw_wait(b);
+}
+
+// Print disk statistics to the console.
+void
+idedump(void)
+{
+  cprintf("ide: %d commands, %d blocks\n", nidecmd, nidebuf);
+}
@@ -73,3 +73,16 @@ ioapicenable(int irq, int cpunum)
   ioapicwrite(REG_TABLE+2*irq, T_IRQ0 + irq);
   ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
 }
+
+// Like ioapicenable, but deliver irq as interrupt vector vec,
+// so that a PCI device on whatever irq the BIOS gave it can use
+// the vector of the driver it replaces.  The PCI INTx line
+// reaches the IO APIC through the PIIX's ISA IRQ routing, which
+// makes it level-triggered and active high; the driver must
+// lower it (for virtio, by reading ISR) before the EOI.
+void
+ioapicroute(int irq, int vec, int cpunum)
+{
+  ioapicwrite(REG_TABLE+2*irq, INT_LEVEL | vec);
+  ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
+}
@@ -1,6 +1,17 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Each CPU keeps a small cache of free pages so that the common
+// kalloc()/kfree() path touches only that CPU's list.  A CPU whose
+// cache runs dry refills KBATCH pages at once from the global
+// freelist, and one whose cache grows past KCACHEMAX drains KBATCH
+// pages back.  If the global list is empty too, kalloc steals half
+// of another CPU's cache.
+//
+// Pages shared copy-on-write after fork carry a reference count;
+// kfree only returns a page to a free list when its count drops
+// to zero.
 
 #include "types.h"
 #include "defs.h"
@@ -8,6 +19,10 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
+
+#define KBATCH     32   // pages moved per refill or drain
+#define KCACHEMAX  (2*KBATCH)  // most pages a CPU cache may hold
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,21 +32,46 @@ struct run {
   struct run *next;
 };
 
+// Per-CPU page cache.  Only its own CPU pushes and pops,
+// but the lock lets other CPUs steal from it.
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+
+  // Statistics, protected by lock.
+  uint nalloc;    // pages handed out by kalloc
+  uint nrefill;   // refills from the global list
+  uint ndrain;    // drains to the global list
+  uint nsteal;    // successful steals from other CPUs
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;
+  struct kcache cpu[NCPU];
+  uint ref[PHYSTOP/PGSIZE];   // references to each physical page
 } kmem;
 
+#define PAGEREF(v)  (kmem.ref[V2P(v)/PGSIZE])
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until kinit2() finishes, every CPU uses the global list directly:
+// mycpu() does not work before mpinit().
 void
 kinit1(void *vstart, void *vend)
 {
+  struct kcache *kc;
+
   initlock(&kmem.lock, "kmem");
+  for(kc = kmem.cpu; kc < &kmem.cpu[NCPU]; kc++)
+    initlock(&kc->lock, "kmem.cpu");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -48,32 +88,110 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    PAGEREF(p) = 1;
     kfree(p);
+  }
 }
+
+// Move up to n pages from *from to *to, returning how many moved.
+static int
+kmove(struct run **to, struct run **from, int n)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < n && (r = *from) != 0; i++){
+    *from = r->next;
+    r->next = *to;
+    *to = r;
+  }
+  return i;
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// Drops one reference; the page is only freed
+// once nobody else shares it.
 void
 kfree(char *v)
 {
   struct run *r;
+  struct kcache *kc;
+  int n;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&PAGEREF(v), 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.nfree++;
+    return;
+  }
+
+  pushcli();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  if(kc->nfree > KCACHEMAX){
+    acquire(&kmem.lock);
+    n = kmove(&kmem.freelist, &kc->freelist, KBATCH);
+    kmem.nfree += n;
     release(&kmem.lock);
+    kc->nfree -= n;
+    kc->ndrain++;
+  }
+  release(&kc->lock);
+  popcli();
+}
+
+// Steal half of some other CPU's cached pages into kc.
+// Called with kc->lock not held, so that two CPUs stealing
+// from each other cannot deadlock.  Returns pages stolen.
+static int
+ksteal(struct kcache *kc)
+{
+  struct kcache *victim;
+  struct run *stolen;
+  int n;
+
+  stolen = 0;
+  n = 0;
+  for(victim = kmem.cpu; victim < &kmem.cpu[ncpu]; victim++){
+    if(victim == kc || victim->nfree == 0)
+      continue;
+    acquire(&victim->lock);
+    n = kmove(&stolen, &victim->freelist, (victim->nfree+1)/2);
+    victim->nfree -= n;
+    release(&victim->lock);
+    if(n > 0)
+      break;
+  }
+  if(n == 0)
+    return 0;
+
+  acquire(&kc->lock);
+  kmove(&kc->freelist, &stolen, n);
+  kc->nfree += n;
+  kc->nsteal++;
+  release(&kc->lock);
+  return n;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +201,91 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kcache *kc;
+  int n;
+
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+      PAGEREF(r) = 1;
+    }
+    return (char*)r;
+  }
 
-  if(kmem.use_lock)
+  pushcli();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist == 0){
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
+    n = kmove(&kc->freelist, &kmem.freelist, KBATCH);
+    kmem.nfree -= n;
     release(&kmem.lock);
+    kc->nfree += n;
+    if(n > 0)
+      kc->nrefill++;
+  }
+  if(kc->freelist == 0){
+    release(&kc->lock);
+    ksteal(kc);
+    acquire(&kc->lock);
+  }
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+    kc->nalloc++;
+  }
+  release(&kc->lock);
+  popcli();
+  if(r)
+    PAGEREF(r) = 1;
   return (char*)r;
 }
 
+// Take another reference to page v, which must
+// already be allocated, for sharing it copy-on-write.
+void
+kref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&PAGEREF(v), 1) == 0)
+    panic("kref: free page");
+}
+
+// Number of references to page v.
+int
+krefcount(char *v)
+{
+  return PAGEREF(v);
+}
+
+// Count the free pages, cached or not.
+// Racy, but good enough to size caches at boot.
+int
+kfreepages(void)
+{
+  struct kcache *kc;
+  int n;
+
+  n = kmem.nfree;
+  for(kc = kmem.cpu; kc < &kmem.cpu[NCPU]; kc++)
+    n += kc->nfree;
+  return n;
+}
+
+// Print per-CPU allocator statistics to the console.
+// Called from procdump; no lock to avoid wedging a stuck machine.
+void
+kallocdump(void)
+{
+  struct kcache *kc;
+
+  cprintf("kmem: %d free in global list\n", kmem.nfree);
+  for(kc = kmem.cpu; kc < &kmem.cpu[ncpu]; kc++)
+    cprintf("cpu%d: %d cached, alloc %d refill %d drain %d steal %d\n",
+            (int)(kc - kmem.cpu), kc->nfree, kc->nalloc,
+            kc->nrefill, kc->ndrain, kc->nsteal);
+}
@@ -0,0 +1,98 @@
+// Stress a busy kernel spin lock from many CPUs.
+//
+//   lockbench [nproc [ptable|kmem]]
+//
+// Starts nproc processes (default 4) that hammer one lock:
+// "ptable" (the default) calls getpriority, which takes
+// ptable.lock; "kmem" grows and shrinks the heap by more pages
+// than a CPU's page cache holds, so that kalloc and kfree go
+// to kmem.lock.  Prints operations per tick and the lock's
+// lockstat counts.  Build the kernel with LOCK=TAS, TICKET or
+// MCS and run with CPUS=8 to compare them.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "lockstat.h"
+
+#define NPTABLE   20000   // getpriority calls per process
+#define NKMEM     200     // heap grow/shrink rounds per process
+#define KMEMPAGES 128     // pages per round
+#define PGSIZE    4096
+
+struct lockstat st[NLOCKCLASS];
+
+void
+hitptable(void)
+{
+  int i, pid;
+
+  pid = getpid();
+  for(i = 0; i < NPTABLE; i++)
+    getpriority(pid);
+}
+
+void
+hitkmem(void)
+{
+  char *p;
+  int i, j;
+
+  for(i = 0; i < NKMEM; i++){
+    if((p = sbrk(KMEMPAGES*PGSIZE)) == (char*)-1){
+      printf(1, "lockbench: sbrk failed\n");
+      return;
+    }
+    for(j = 0; j < KMEMPAGES; j++)
+      p[j*PGSIZE] = 1;
+    if(sbrk(-KMEMPAGES*PGSIZE) == (char*)-1){
+      printf(1, "lockbench: sbrk shrink failed\n");
+      return;
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nproc, kmem, i, n, t0, t1, ops;
+  char *name;
+
+  nproc = 4;
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  kmem = argc > 2 && strcmp(argv[2], "kmem") == 0;
+  if(nproc < 1 || (argc > 2 && !kmem && strcmp(argv[2], "ptable") != 0)){
+    printf(2, "usage: lockbench [nproc [ptable|kmem]]\n");
+    exit();
+  }
+  name = kmem ? "kmem" : "ptable";
+  ops = kmem ? NKMEM : NPTABLE;
+
+  lockstat(st, 0, 1);
+  t0 = uptime();
+  for(i = 0; i < nproc; i++){
+    if(fork() == 0){
+      if(kmem)
+        hitkmem();
+      else
+        hitptable();
+      exit();
+    }
+  }
+  for(i = 0; i < nproc; i++)
+    wait();
+  t1 = uptime();
+  n = lockstat(st, NLOCKCLASS, 0);
+
+  if(t1 == t0)
+    t1++;
+  printf(1, "lockbench: %d procs x %d %s ops, %d ticks, %d ops/tick\n",
+         nproc, ops, name, t1-t0, nproc*ops/(t1-t0));
+  for(i = 0; i < n; i++)
+    if(strcmp(st[i].name, name) == 0)
+      printf(1, "%s: acquire %d contend %d spin %d hold %d kcycles\n",
+             name, st[i].nacquire, st[i].ncontend, st[i].nspin, st[i].hold);
+  exit();
+}
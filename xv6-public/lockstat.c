@@ -0,0 +1,75 @@
+// Print kernel spin lock statistics.
+//
+//   lockstat            print counts since boot or the last reset
+//   lockstat -r         reset the counts
+//   lockstat cmd [arg...]
+//                       reset, run cmd, and print what it caused
+//
+// One line per lock name, most contended first: locks with the
+// name, acquisitions, acquisitions that had to wait, spin loops,
+// total and longest hold time.  Below it, the callers of acquire
+// that waited most; look their addresses up in kernel.asm.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "lockstat.h"
+
+struct lockstat st[NLOCKCLASS];
+
+void
+print(int n)
+{
+  struct lockstat t;
+  int i, j;
+
+  // Insertion sort by contention, then by acquisitions.
+  for(i = 1; i < n; i++){
+    t = st[i];
+    for(j = i; j > 0 && (st[j-1].ncontend < t.ncontend ||
+        (st[j-1].ncontend == t.ncontend && st[j-1].nacquire < t.nacquire)); j--)
+      st[j] = st[j-1];
+    st[j] = t;
+  }
+
+  printf(1, "name: locks acquire contend spin hold(kcycles) maxhold(cycles)\n");
+  for(i = 0; i < n; i++){
+    if(st[i].nacquire == 0)
+      continue;
+    printf(1, "%s: %d %d %d %d %d %d\n", st[i].name, st[i].nlock,
+           st[i].nacquire, st[i].ncontend, st[i].nspin,
+           st[i].hold, st[i].maxhold);
+    for(j = 0; j < LSSITES; j++)
+      if(st[i].sitecnt[j] > 0)
+        printf(1, "  %x waited %d\n", st[i].sitepc[j], st[i].sitecnt[j]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    lockstat(st, 0, 1);
+    exit();
+  }
+
+  if(argc > 1){
+    lockstat(st, 0, 1);
+    if(fork() == 0){
+      exec(argv[1], argv+1);
+      printf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit();
+    }
+    wait();
+  }
+
+  if((n = lockstat(st, NLOCKCLASS, 0)) < 0){
+    printf(2, "lockstat: failed\n");
+    exit();
+  }
+  print(n);
+  exit();
+}
@@ -0,0 +1,15 @@
+// Spin lock statistics, one record per lock name (see lockstat()).
+#define LSNAME     16   // bytes of the lock name kept
+#define LSSITES     4   // most contended call sites kept per name
+
+struct lockstat {
+  char name[LSNAME];
+  uint nlock;             // live locks with this name
+  uint nacquire;          // acquisitions
+  uint ncontend;          // ... that found the lock held
+  uint nspin;             // spin loops waiting for it
+  uint hold;              // total time held, in 1024-cycle units
+  uint maxhold;           // longest hold, in cycles
+  uint sitepc[LSSITES];   // callers of acquire that most often waited
+  uint sitecnt[LSSITES];  // ... and how often, 0 if unused
+};
@@ -11,8 +11,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when there
+// are no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -20,32 +20,77 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the open transaction is closed.  begin_op()
+// reserves MAXOPBLOCKS blocks of the transaction; a call that
+// may write more, like a large write(), reserves what it needs
+// with begin_opn(), up to log_opmax().
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The log is a physical re-do log containing disk blocks,
+// split into two regions used alternately (group commit).
+// When the last outstanding end_op() closes a transaction, the
+// closer copies its blocks out of the buffer cache and opens the
+// other region, so new system calls can run while the closed
+// transaction is written to its region.  A commit that finishes
+// picks up whatever transaction has collected in the meantime.
+//
+// Installing a committed transaction to its home locations is
+// deferred until its region is needed again (or sync() asks for
+// it), and is done in block order.  Until then the home blocks
+// stay pinned in the cache with B_DIRTY.
+//
+// mkfs sizes the log.  Each region takes half of it, and holds
+// as many blocks as fit after the header that lists them (up to
+// LOGSIZE).  The on-disk format of each region:
+//   header blocks, containing sequence # and block #s for A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The first header block, holding the count, is written last,
+// so that it commits the transaction.  Recovery replays the
+// committed regions in sequence order.
 
-// Contents of the header block, used for both the on-disk header block
+// Contents of the header blocks, used for both the on-disk header
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint seq;
   int block[LOGSIZE];
 };
 
+#define LOGHASH 1024  // absorption hash slots per region; > 2*LOGSIZE, power of 2
+
+// States of a log region.
+enum { LR_CLEAN, LR_OPEN, LR_COMMITTING, LR_COMMITTED };
+
+struct logregion {
+  int start;         // block number of the region's header
+  int state;
+  struct logheader lh;
+  short slot[LOGHASH];  // index+1 in lh.block of each logged block, hashed
+  char *copy[LOGSIZE];  // block contents as of closing the transaction
+};
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // blocks per transaction
+  int nhdr;        // header blocks per region
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they have reserved
+  int closing;     // in commit(), closing the open transaction, please wait.
   int dev;
-  struct logheader lh;
+  uint seq;        // sequence number of the next transaction
+  int cur;         // region of the open transaction
+  uint ncommit;    // statistics, for logdump
+  uint nlogged;
+  uint nabsorb;
+  struct logregion region[2];
+  struct buf ibuf; // for installing blocks the cache holds newer copies of
+  struct buf *to[LOGSIZE];        // write_log's writes in flight
+  int order[LOGSIZE];             // install_trans's, in block order
+  struct buf *inflight[LOGSIZE];
 };
 struct log log;
 
@@ -55,209 +100,402 @@ static void commit();
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  struct logregion *lr;
+  char *mem;
+  int i;
 
   struct superblock sb;
   initlock(&log.lock, "log");
+  initsleeplock(&log.ibuf.lock, "log install");
+  if ((log.ibuf.data = (uchar*)kalloc()) == 0)
+    panic("initlog: out of memory");
   readsb(dev, &sb);
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  log.cap = log.size/2 - LOGHDRBLOCKS(0);
+  while (log.cap > 0 && log.cap + LOGHDRBLOCKS(log.cap) > log.size/2)
+    log.cap--;
+  if (log.cap > LOGSIZE)
+    log.cap = LOGSIZE;
+  // The open and the committing region each pin up to cap
+  // blocks in the buffer cache, and write_log holds cap log
+  // blocks at once; the cache must hold all that and more.
+  if (log.cap > (bcachesize() - BUFSLACK)/3)
+    log.cap = (bcachesize() - BUFSLACK)/3;
+  if (log.cap < 3*MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.nhdr = LOGHDRBLOCKS(log.cap);
+
+  mem = 0;
+  for (lr = log.region; lr < &log.region[2]; lr++) {
+    lr->start = log.start + (lr - log.region)*(log.size/2);
+    for (i = 0; i < log.cap; i++) {
+      if ((uint)mem % PGSIZE == 0 && (mem = kalloc()) == 0)
+        panic("initlog: out of memory");
+      lr->copy[i] = mem;
+      mem += BSIZE;
+    }
+  }
+
   recover_from_log();
+
+  log.cur = 0;
+  log.region[0].state = LR_OPEN;
+  log.region[0].lh.seq = log.seq++;
+  log.region[1].state = LR_CLEAN;
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int read_from_log)
+// Header block i of a region holds bytes [i*BSIZE, (i+1)*BSIZE)
+// of its logheader.
+static uint
+hdrbytes(int i, int n)
 {
-  int tail;
-  struct buf *lbuf, *dbuf;
+  uint end;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-
-    if(read_from_log) {
-      lbuf = bread(log.dev, log.start+tail+1); // read log block
-      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-      brelse(lbuf);
-    }
-
-    bwrite(dbuf);  // write dst to disk
-    brelse(dbuf);
-  }
+  end = (2 + n)*sizeof(uint);
+  if (end > (i+1)*BSIZE)
+    end = (i+1)*BSIZE;
+  return end - i*BSIZE;
 }
 
-// Read the log header from disk into the in-memory log header
+// Read a region's log header from disk into its in-memory log header
 static void
-read_head(void)
+read_head(struct logregion *lr)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *buf;
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+
+  buf = bread(log.dev, lr->start);
+  memmove(&lr->lh, buf->data, hdrbytes(0, 0));
   brelse(buf);
+  if (lr->lh.n < 0 || lr->lh.n > log.cap)
+    panic("read_head: bad log header");
+  for (i = 0; i < LOGHDRBLOCKS(lr->lh.n); i++) {
+    buf = bread(log.dev, lr->start + i);
+    memmove((char*)&lr->lh + i*BSIZE, buf->data, hdrbytes(i, lr->lh.n));
+    brelse(buf);
+  }
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write a region's in-memory log header to disk.  Writing
+// the first header block, after the rest, is the true point
+// at which its transaction commits.
 static void
-write_head(void)
+write_head(struct logregion *lr)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct buf *buf;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  for (i = LOGHDRBLOCKS(lr->lh.n) - 1; i >= 0; i--) {
+    buf = bread(log.dev, lr->start + i);
+    memmove(buf->data, (char*)&lr->lh + i*BSIZE, hdrbytes(i, lr->lh.n));
+    bwrite(buf);
+    brelse(buf);
   }
-  bwrite(buf);
-  brelse(buf);
 }
 
-/* Good code */
+// Copy committed blocks from the log on disk to their home
+// location.  Used only by recovery, when the cache is cold.
+static void
+replay(struct logregion *lr)
+{
+  int tail;
+  struct buf *lbuf, *dbuf;
 
+  for (tail = 0; tail < lr->lh.n; tail++) {
+    lbuf = bread(log.dev, lr->start+log.nhdr+tail); // read log block
+    dbuf = bread(log.dev, lr->lh.block[tail]); // read dst
+    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+    bwrite(dbuf);  // write dst to disk
+    brelse(lbuf);
+    brelse(dbuf);
+  }
+  lr->lh.n = 0;
+  write_head(lr); // clear the region
+}
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  cprintf("recovery: n=%d\n", log.lh.n);
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logregion *r0 = &log.region[0], *r1 = &log.region[1];
+
+  read_head(r0);
+  read_head(r1);
+  cprintf("recovery: n=%d,%d\n", r0->lh.n, r1->lh.n);
+  // if committed, copy from log to disk, oldest first
+  if ((int)(r1->lh.seq - r0->lh.seq) < 0) {
+    replay(r1);
+    replay(r0);
+  } else {
+    replay(r0);
+    replay(r1);
+  }
+  log.seq = (int)(r1->lh.seq - r0->lh.seq) < 0 ? r0->lh.seq : r1->lh.seq;
+  log.seq++;
 }
 
+// Most blocks one FS system call may reserve: half a
+// transaction, so that others can run alongside it.
+int
+log_opmax(void)
+{
+  return log.cap/2;
+}
 
- /*
-   LEC 13 homework: break logging code
-   Bad code
- */
-/* static void */
-/* recover_from_log(void) */
-/* { */
-/*   read_head(); */
-/*   cprintf("recovery: n=%d but ignoring\n", log.lh.n); */
-/*   // install_trans(); */
-/*   log.lh.n = 0; */
-/*   // write_head(); */
-/* } */
-
-
-// called at the start of each FS system call.
+// called at the start of an FS system call that may write
+// up to nblocks blocks.
 void
-begin_op(void)
+begin_opn(int nblocks)
 {
+  struct logregion *lr;
+
+  if(nblocks > log_opmax())
+    panic("begin_opn");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    lr = &log.region[log.cur];
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(lr->lh.n + log.reserved + nblocks > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += nblocks;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of an FS system call started with
+// begin_opn(nblocks).  commits if this was the last
+// outstanding operation.
+void
+end_opn(int nblocks)
 {
   int do_commit = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= nblocks;
+  if(log.closing)
+    panic("log.closing");
+  if(log.outstanding == 0)
     do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
 
   if(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Copy the closed transaction's blocks out of the cache,
+// so that the next transaction may modify the cached copies
+// while this one is written to the log.
 static void
-write_log(void)
+copy_trans(struct logregion *lr)
 {
   int tail;
+  struct buf *b;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < lr->lh.n; tail++) {
+    b = bread(log.dev, lr->lh.block[tail]); // pinned, so cached
+    memmove(lr->copy[tail], b->data, BSIZE);
+    brelse(b);
   }
 }
 
-
+// Write the closed transaction's blocks to its log region.
+// The log blocks are consecutive, so write them all at once
+// and let the disk driver merge them.
 static void
-commit()
+write_log(struct logregion *lr)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
+  int tail;
+  struct buf **to = log.to;
+
+  for (tail = 0; tail < lr->lh.n; tail++) {
+    to[tail] = bread(log.dev, lr->start+log.nhdr+tail); // log block
+    memmove(to[tail]->data, lr->copy[tail], BSIZE);
+    bwrite_async(to[tail]);  // write the log
+  }
+  for (tail = 0; tail < lr->lh.n; tail++) {
+    biowait(to[tail]);
+    brelse(to[tail]);
+  }
+}
 
-    install_trans(0); // Now install writes to home locations
+//PAGEBREAK!
+// Install a committed transaction to home locations, in block
+// order, and clear its region for reuse.  A home block that no
+// later transaction has logged is written from the cache, which
+// also unpins it; otherwise the cache copy is newer than this
+// transaction and stays pinned, and the logged copy is written
+// through log.ibuf instead.
+static void
+install_trans(struct logregion *lr)
+{
+  int i, j, t, *order = log.order;
+  struct buf *b, **inflight = log.inflight;
+
+  for (i = 0; i < lr->lh.n; i++) {
+    t = i;
+    for (j = i; j > 0 && lr->lh.block[order[j-1]] > lr->lh.block[t]; j--)
+      order[j] = order[j-1];
+    order[j] = t;
+  }
 
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  for (i = 0; i < lr->lh.n; i++) {
+    t = order[i];
+    b = bread(log.dev, lr->lh.block[t]); // pinned, so cached
+    if (b->logseq == lr->lh.seq) {
+      bwrite_async(b);  // write dst to disk, clears B_DIRTY
+      inflight[i] = b;
+    } else {
+      acquiresleep(&log.ibuf.lock);
+      log.ibuf.dev = log.dev;
+      log.ibuf.blockno = lr->lh.block[t];
+      log.ibuf.flags = B_DIRTY;
+      memmove(log.ibuf.data, lr->copy[t], BSIZE);
+      iderw(&log.ibuf);
+      releasesleep(&log.ibuf.lock);
+      brelse(b);
+      inflight[i] = 0;
+    }
+  }
+  for (i = 0; i < lr->lh.n; i++) {
+    if (inflight[i]) {
+      biowait(inflight[i]);
+      brelse(inflight[i]);
+    }
   }
+
+  lr->lh.n = 0;
+  write_head(lr);    // Erase the transaction from the log
 }
 
+// Close the open transaction and commit it, then keep committing
+// transactions that collect while doing so.  Returns without
+// committing if FS system calls are outstanding (the last of them
+// will commit) or another commit is writing the other region
+// (it will loop around and commit this transaction).
+static void
+commit()
+{
+  struct logregion *lr, *next;
+
+  acquire(&log.lock);
+  for(;;){
+    lr = &log.region[log.cur];
+    next = &log.region[1 - log.cur];
+    if(log.outstanding > 0 || log.closing || lr->lh.n == 0 ||
+       next->state == LR_COMMITTING)
+      break;
+
+    // No system calls are active and begin_op() waits while
+    // closing, so the transaction's blocks cannot change under us.
+    log.closing = 1;
+    release(&log.lock);
 
-/*
-  LEC 13 homework: break logging code
-  Bad code
- */
-/* void */
-/* commit(void) */
-/* { */
-/*   int pid = myproc()->pid; */
-/*   if (log.lh.n > 0) { */
-/*     write_log(); */
-/*     write_head(); */
+    copy_trans(lr);
+    if(next->state == LR_COMMITTED)
+      install_trans(next);  // deferred until its region is needed
+    memset(next->slot, 0, sizeof(next->slot));
+
+    acquire(&log.lock);
+    lr->state = LR_COMMITTING;
+    next->state = LR_OPEN;
+    next->lh.n = 0;
+    next->lh.seq = log.seq++;
+    log.cur = next - log.region;
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log(lr);     // Write the copied blocks to the log
+    write_head(lr);    // Write header to disk -- the real commit
+
+    acquire(&log.lock);
+    lr->state = LR_COMMITTED;
+    log.ncommit++;
+    log.nlogged += lr->lh.n;
+    wakeup(&log);
+  }
+  release(&log.lock);
+}
 
-/*     if(pid > 1) {        // AAA */
-/*       cprintf("log.lh.block[0]: %d\n", log.lh.block[0]); */
-/*       log.lh.block[0] = 0; // BBB */
-/*     } */
+// Make every completed FS system call durable: commit the open
+// transaction and wait for any commit in progress.  With install,
+// also write everything home, leaving the log empty.
+// Must not be called inside a transaction.
+static void
+flush_log(int install)
+{
+  struct logregion *lr, *next;
 
-/*     install_trans(); */
+  acquire(&log.lock);
+  for(;;){
+    lr = &log.region[log.cur];
+    next = &log.region[1 - log.cur];
+    if(log.outstanding == 0 && !log.closing && lr->lh.n > 0 &&
+       next->state != LR_COMMITTING){
+      release(&log.lock);
+      commit();
+      acquire(&log.lock);
+    } else if(lr->lh.n == 0 && next->state != LR_COMMITTING){
+      break;
+    } else {
+      sleep(&log, &log.lock);
+    }
+  }
 
-/*     if(pid > 1)            // AAA */
-/*       panic("commit mimicking crash"); // CCC */
+  if(install && next->state == LR_COMMITTED){
+    // Keep new transactions out while installing, as commit() does.
+    while(log.outstanding > 0 || log.closing)
+      sleep(&log, &log.lock);
+    next = &log.region[1 - log.cur];
+    if(next->state == LR_COMMITTED){
+      log.closing = 1;
+      release(&log.lock);
+      install_trans(next);
+      acquire(&log.lock);
+      next->state = LR_CLEAN;
+      log.closing = 0;
+      wakeup(&log);
+    }
+  }
+  release(&log.lock);
+}
 
-/*     log.lh.n = 0; */
-/*     write_head(); */
-/*   } */
-/* } */
+// sync()/fsync(): on return, all completed FS system calls
+// are on disk and the log has been installed.
+void
+log_sync(void)
+{
+  flush_log(1);
+}
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
@@ -271,21 +509,36 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  int i, h;
+  struct logregion *lr;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
+  acquire(&log.lock);
+  lr = &log.region[log.cur];
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  // log absorbtion: find the block if already logged
+  for (h = b->blockno % LOGHASH; (i = lr->slot[h]) != 0; h = (h+1) % LOGHASH) {
+    if (lr->lh.block[i-1] == b->blockno)
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
+  if (i == 0) {
+    if (lr->lh.n >= log.cap)
+      panic("too big a transaction");
+    lr->lh.block[lr->lh.n++] = b->blockno;
+    lr->slot[h] = lr->lh.n;
+  } else {
+    log.nabsorb++;
+  }
   b->flags |= B_DIRTY; // prevent eviction
+  b->logseq = lr->lh.seq;
   release(&log.lock);
 }
+
+// Print log statistics.  No lock, like bcachedump.
+void
+logdump(void)
+{
+  cprintf("log: %d blocks per transaction: commit %d, blocks %d, absorbed %d\n",
+          log.cap, log.ncommit, log.nlogged, log.nabsorb);
+}
@@ -0,0 +1,119 @@
+// Measure malloc and free.
+//  - small: N malloc/free pairs of 32 bytes;
+//  - mixed: N random operations on a pool of live blocks of
+//    random sizes, mostly small, some up to 16KB, so the heap
+//    fragments and coalesces;
+//  - threads: nthreads (default 4) threads each doing the small
+//    test at once; run with CPUS >= nthreads.
+// Each test checks that blocks keep their contents.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define N     200000
+#define NLIVE 1000
+#define MAXT  8
+
+char *live[NLIVE];
+uint livesz[NLIVE];
+volatile int bad;
+
+uint
+rnd(uint *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+void
+small(void *arg1, void *arg2)
+{
+  char *p;
+  int i;
+
+  for(i = 0; i < N; i++){
+    if((p = malloc(32)) == 0){
+      bad = 1;
+      break;
+    }
+    p[0] = i;
+    p[31] = i;
+    if(p[0] != (char)i || p[31] != (char)i)
+      bad = 1;
+    free(p);
+  }
+}
+
+void
+mixed(void)
+{
+  uint seed, i, j, k;
+
+  seed = 1;
+  for(i = 0; i < N; i++){
+    j = rnd(&seed) % NLIVE;
+    if(live[j]){
+      for(k = 0; k < livesz[j]; k += 64)
+        if(live[j][k] != (char)(j+k))
+          bad = 1;
+      free(live[j]);
+      live[j] = 0;
+      continue;
+    }
+    livesz[j] = rnd(&seed) % 8 ? rnd(&seed) % 256 : rnd(&seed) % 16384;
+    if((live[j] = malloc(livesz[j])) == 0){
+      bad = 1;
+      return;
+    }
+    for(k = 0; k < livesz[j]; k += 64)
+      live[j][k] = j+k;
+  }
+  for(j = 0; j < NLIVE; j++)
+    free(live[j]);
+}
+
+void
+report(char *name, int ops, int t0)
+{
+  int t1;
+
+  t1 = uptime();
+  if(t1 == t0)
+    t1++;
+  printf(1, "mallocbench: %s: %d ops in %d ticks, %d ops/tick%s\n",
+         name, ops, t1-t0, ops/(t1-t0), bad ? ", CORRUPT" : "");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nthreads, i, t0;
+
+  nthreads = 4;
+  if(argc > 1)
+    nthreads = atoi(argv[1]);
+  if(nthreads < 1 || nthreads > MAXT){
+    printf(2, "usage: mallocbench [nthreads (1-%d)]\n", MAXT);
+    exit();
+  }
+
+  t0 = uptime();
+  small(0, 0);
+  report("small", 2*N, t0);
+
+  t0 = uptime();
+  mixed();
+  report("mixed", N, t0);
+
+  t0 = uptime();
+  for(i = 0; i < nthreads; i++)
+    if(kthread_create(small, 0, 0) < 0){
+      printf(2, "mallocbench: kthread_create failed\n");
+      exit();
+    }
+  for(i = 0; i < nthreads; i++)
+    kthread_join();
+  report("threads", 2*N*nthreads, t0);
+  exit();
+}
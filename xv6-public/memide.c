@@ -5,10 +5,10 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -35,6 +35,7 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// The memory disk is synchronous, so this is also iderw_start.
 void
 iderw(struct buf *b)
 {
@@ -58,3 +59,21 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+void
+iderw_start(struct buf *b)
+{
+  iderw(b);
+  if(b->flags & B_ASYNC)
+    biodone(b);
+}
+
+void
+iderw_wait(struct buf *b)
+{
+}
+
+void
+idedump(void)
+{
+}
@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -31,7 +31,7 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
-
+int extents;  // -e: build an FS_EXTENT file system
 
 void balloc(int);
 void wsect(uint, void*);
@@ -68,7 +68,7 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum, off, flags;
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
@@ -76,8 +76,16 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  flags = 0;
+  if(argc > 1 && strcmp(argv[1], "-e") == 0){
+    extents = 1;
+    flags |= FS_EXTENT;
+    argc--;
+    argv++;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-e] fs.img files...\n");
     exit(1);
   }
 
@@ -90,6 +98,14 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  // The log: two regions of a header and LOGSIZE blocks, or
+  // fewer blocks if that would take more than an eighth of
+  // the disk.
+  for(i = LOGSIZE; i > 3*MAXOPBLOCKS; i /= 2)
+    if(2*(LOGHDRBLOCKS(i) + i) <= FSSIZE/8)
+      break;
+  nlog = 2*(LOGHDRBLOCKS(i) + i);
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -101,9 +117,11 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint(flags);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d block size %d%s\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE, BSIZE,
+         extents ? " extents" : "");
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -142,6 +160,11 @@ main(int argc, char *argv[])
     if(argv[i][0] == '_')
       ++argv[i];
 
+    if(strlen(argv[i]) > DIRSIZ){
+      fprintf(stderr, "mkfs: name too long: %s\n", argv[i]);
+      exit(1);
+    }
+
     inum = ialloc(T_FILE);
 
     bzero(&de, sizeof(de));
@@ -252,6 +275,34 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block holding file block fbn of din,
+// allocating it at freeblock if fbn is the next block of the file.
+// Blocks handed out in order to one file share an extent.
+uint
+extentmap(struct dinode *din, uint fbn)
+{
+  struct extent *ex;
+  uint base;
+  int i;
+
+  ex = (struct extent*)din->addrs;
+  base = 0;
+  for(i = 0; i < NEXTENT && xint(ex[i].len) != 0; i++){
+    if(fbn < base + xint(ex[i].len))
+      return xint(ex[i].start) + fbn - base;
+    base += xint(ex[i].len);
+  }
+  assert(fbn == base);
+  if(i > 0 && xint(ex[i-1].start) + xint(ex[i-1].len) == freeblock){
+    ex[i-1].len = xint(xint(ex[i-1].len) + 1);
+  } else {
+    assert(i < NEXTENT);
+    ex[i].start = xint(freeblock);
+    ex[i].len = xint(1);
+  }
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -260,7 +311,7 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, dbn;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -268,12 +319,14 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = extentmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
@@ -283,6 +336,24 @@ iappend(uint inum, void *xp, int n)
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
+    } else {
+      // Doubly-indirect, laid out as in bmap().
+      dbn = fbn - NDIRECT - NINDIRECT;
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
+      }
+      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      if(indirect[dbn / NINDIRECT] == 0){
+        indirect[dbn / NINDIRECT] = xint(freeblock++);
+        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      }
+      x = xint(indirect[dbn / NINDIRECT]);
+      rsect(x, (char*)indirect);
+      if(indirect[dbn % NINDIRECT] == 0){
+        indirect[dbn % NINDIRECT] = xint(freeblock++);
+        wsect(x, (char*)indirect);
+      }
+      x = xint(indirect[dbn % NINDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
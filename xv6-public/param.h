@@ -1,15 +1,30 @@
-#define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define NSLEEPQ      61  // wait channel hash buckets (prime)
+#define NLOCKCLASS   64  // lock names counted apart by lockstat
+#define NPRIO         4  // scheduler priority levels, 0 highest
+#define QUANTUM       1  // time slice at priority 0, in ticks; doubles per level
+#define BOOSTTICKS  100  // ticks between raising everyone to their base level
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define PIPEPAGES     4  // pages in a pipe's ring buffer (power of 2)
+#define NVMA         16  // exec segments and mmap regions per process
+#define NPCACHE     256  // pages in the executable page cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      512  // max data blocks in a log transaction
+#define BUFSLACK      64  // buffers left over after what the log pins
+#define NBUF         (3*3*MAXOPBLOCKS + BUFSLACK)  // minimum size of disk block cache
+#define NBUFMAX      4096  // maximum size of disk block cache
+#define NBUCKET       251  // buffer cache hash buckets (prime)
+#define BCACHEFRAC     32  // give 1/BCACHEFRAC of free memory to bcache
+#define RAMIN          4  // initial readahead window, in blocks
+#define RAMAX         32  // largest readahead window, in blocks
+#define NDCACHE      256  // directory name cache entries
+#define DCWAYS         4  // name cache entries per hash set
+#define NIHASH       127  // inode cache hash buckets (prime)
+#define NINODELRU    256  // unreferenced inodes kept cached
 //#define FSSIZE       1000  // size of file system in blocks
 // modify for LEC12 homework: big files
 #define FSSIZE       20000  // size of file system in blocks
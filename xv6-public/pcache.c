@@ -0,0 +1,166 @@
+// Page cache for demand-paged executables.
+//
+// exec() no longer reads a program into memory; it records the
+// program's segments as VMAs and vmfault() fills pages in from
+// the file on first touch.  Pages read that way are kept here,
+// keyed by (dev, inum, file offset), so that every process
+// running the same binary maps the same physical pages:
+// read-only, or copy-on-write for writable segments.
+//
+// The cache holds one reference (see kref) on each page it
+// keeps.  Writing or freeing a file drops its cached pages;
+// processes that already map them keep the old contents.
+// ip->pcached says whether the cache may hold pages of ip, so
+// that ordinary writes need not look.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+struct pcentry {
+  uint dev;
+  uint inum;        // 0 if the entry is unused
+  uint off;         // file offset of the page
+  uint n;           // bytes from the file; the rest is zero
+  char *page;
+  uint lastuse;
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct pcentry entry[NPCACHE];
+
+  // Statistics, protected by lock.
+  uint nhit;
+  uint nmiss;
+} pcache;
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Caller holds pcache.lock.
+static struct pcentry*
+pcfind(uint dev, uint inum, uint off, uint n)
+{
+  struct pcentry *e;
+
+  for(e = pcache.entry; e < &pcache.entry[NPCACHE]; e++)
+    if(e->inum == inum && e->dev == dev && e->off == off && e->n == n)
+      return e;
+  return 0;
+}
+
+// Return a page holding n bytes of ip at offset off followed
+// by zeroes, with a reference for the caller, or 0 if out of
+// memory or the read fails.  ip must not be locked.
+char*
+pcget(struct inode *ip, uint off, uint n)
+{
+  struct pcentry *e, *x;
+  char *mem;
+
+  acquire(&pcache.lock);
+  if((e = pcfind(ip->dev, ip->inum, off, n)) != 0){
+    e->lastuse = ++pcache.clock;
+    pcache.nhit++;
+    kref(e->page);
+    release(&pcache.lock);
+    return e->page;
+  }
+  pcache.nmiss++;
+  release(&pcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem + n, 0, PGSIZE - n);
+  ilock(ip);
+  if(readi(ip, mem, off, n) != n){
+    iunlock(ip);
+    kfree(mem);
+    return 0;
+  }
+  ip->pcached = 1;
+
+  // Insert, unless someone else read the page meanwhile.
+  // Still holding ip->lock, so no write can slip in between.
+  acquire(&pcache.lock);
+  if((e = pcfind(ip->dev, ip->inum, off, n)) != 0){
+    kref(e->page);
+    release(&pcache.lock);
+    iunlock(ip);
+    kfree(mem);
+    return e->page;
+  }
+  e = pcache.entry;
+  for(x = pcache.entry; x < &pcache.entry[NPCACHE]; x++){
+    if(x->inum == 0){
+      e = x;
+      break;
+    }
+    if(x->lastuse < e->lastuse)
+      e = x;
+  }
+  if(e->inum != 0)
+    kfree(e->page);
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->n = n;
+  e->page = mem;
+  e->lastuse = ++pcache.clock;
+  kref(mem);
+  release(&pcache.lock);
+  iunlock(ip);
+  return mem;
+}
+
+// Does the cache hold any pages of (dev, inum)?
+int
+pccached(uint dev, uint inum)
+{
+  struct pcentry *e;
+  int r;
+
+  r = 0;
+  acquire(&pcache.lock);
+  for(e = pcache.entry; e < &pcache.entry[NPCACHE]; e++)
+    if(e->inum == inum && e->dev == dev)
+      r = 1;
+  release(&pcache.lock);
+  return r;
+}
+
+// Drop the cached pages of ip, which is about to change.
+// Caller holds ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct pcentry *e;
+
+  acquire(&pcache.lock);
+  for(e = pcache.entry; e < &pcache.entry[NPCACHE]; e++){
+    if(e->inum == ip->inum && e->dev == ip->dev){
+      kfree(e->page);
+      e->inum = 0;
+    }
+  }
+  release(&pcache.lock);
+  ip->pcached = 0;
+}
+
+// Print page cache statistics.  No lock, like bcachedump.
+void
+pcachedump(void)
+{
+  cprintf("pcache: %d pages: hit %d miss %d\n",
+          NPCACHE, pcache.nhit, pcache.nmiss);
+}
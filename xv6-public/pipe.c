@@ -2,39 +2,89 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
-#include "spinlock.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// The ring buffer is PIPEPAGES separately allocated pages.
+// Reads and writes move data with ucopy, one run of bytes
+// that is contiguous within a page at a time; a fault on the
+// user's buffer, which cannot be handled under p->lock, fails
+// the call.  Sleepers are
+// counted, so that nobody calls wakeup for nothing: a writer
+// wakes readers once it has buffered PIPEWMARK bytes and when
+// it is done, and a reader wakes writers once there is as much
+// room as they asked for (wneed), so a big transfer moves in
+// large chunks instead of ping-ponging.
+#define PIPESIZE  (PIPEPAGES*PGSIZE)
+#define PIPEWMARK (PIPESIZE/2)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data[PIPEPAGES];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int nrsleep;    // readers sleeping on nread
+  int nwsleep;    // writers sleeping on nwrite
+  uint wneed;     // room the sleeping writers are waiting for
 };
 
+static struct kmcache pipecache;
+
+void
+pipeinit(void)
+{
+  kmcinit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
+// Address of byte off of the ring, and how many bytes
+// from there on are contiguous.
+static char*
+pipeaddr(struct pipe *p, uint off, uint *contig)
+{
+  *contig = PGSIZE - off%PGSIZE;
+  return p->data[(off/PGSIZE) % PIPEPAGES] + off%PGSIZE;
+}
+
+static void
+pipefree(struct pipe *p)
+{
+  int i;
+
+  for(i = 0; i < PIPEPAGES; i++)
+    if(p->data[i])
+      kfree(p->data[i]);
+  droplock(&p->lock);
+  kmcfree(&pipecache, p);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *p;
+  int i;
 
   p = 0;
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((p = (struct pipe*)kalloc()) == 0)
+  if((p = kmcalloc(&pipecache)) == 0)
     goto bad;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "pipe");
+  for(i = 0; i < PIPEPAGES; i++)
+    if((p->data[i] = kalloc()) == 0)
+      goto bad;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
   p->nread = 0;
-  initlock(&p->lock, "pipe");
+  p->wneed = PIPESIZE;
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -48,7 +98,7 @@ pipealloc(struct file **f0, struct file **f1)
 //PAGEBREAK: 20
  bad:
   if(p)
-    kfree((char*)p);
+    pipefree(p);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -69,7 +119,7 @@ pipeclose(struct pipe *p, int writable)
   }
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    pipefree(p);
   } else
     release(&p->lock);
 }
@@ -78,21 +128,46 @@ pipeclose(struct pipe *p, int writable)
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
-  int i;
+  uint i, m, room, contig;
+  char *dst;
 
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
-      if(p->readopen == 0 || myproc()->killed){
-        release(&p->lock);
-        return -1;
-      }
-      wakeup(&p->nread);
+  for(i = 0; i < n; i += m){
+    if(p->readopen == 0 || myproc()->killed){
+      release(&p->lock);
+      return -1;
+    }
+    room = PIPESIZE - (p->nwrite - p->nread);
+    if(room == 0){  //DOC: pipewrite-full
+      if(p->nrsleep)
+        wakeup(&p->nread);
+      // Sleep until there is room for the rest of the
+      // write, or half the ring, whichever is less.
+      m = n - i < PIPEWMARK ? n - i : PIPEWMARK;
+      if(m < p->wneed)
+        p->wneed = m;
+      p->nwsleep++;
       sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+      p->nwsleep--;
+      m = 0;
+      continue;
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    dst = pipeaddr(p, p->nwrite, &contig);
+    m = n - i;
+    if(m > room)
+      m = room;
+    if(m > contig)
+      m = contig;
+    if(ucopy(dst, addr + i, m) < 0){
+      release(&p->lock);
+      return -1;
+    }
+    p->nwrite += m;
+    if(p->nrsleep && p->nwrite - p->nread >= PIPEWMARK)
+      wakeup(&p->nread);
   }
-  wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  if(p->nrsleep)
+    wakeup(&p->nread);  //DOC: pipewrite-wakeup1
   release(&p->lock);
   return n;
 }
@@ -100,7 +175,8 @@ pipewrite(struct pipe *p, char *addr, int n)
 int
 piperead(struct pipe *p, char *addr, int n)
 {
-  int i;
+  uint i, m, avail, contig;
+  char *src;
 
   acquire(&p->lock);
   while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
@@ -108,14 +184,30 @@ piperead(struct pipe *p, char *addr, int n)
       release(&p->lock);
       return -1;
     }
+    p->nrsleep++;
     sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    p->nrsleep--;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
+    if((avail = p->nwrite - p->nread) == 0)
       break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+    src = pipeaddr(p, p->nread, &contig);
+    m = n - i;
+    if(m > avail)
+      m = avail;
+    if(m > contig)
+      m = contig;
+    if(ucopy(addr + i, src, m) < 0){
+      if(i == 0)
+        i = -1;
+      break;
+    }
+    p->nread += m;
+  }
+  if(p->nwsleep && PIPESIZE - (p->nwrite - p->nread) >= p->wneed){
+    p->wneed = PIPESIZE;
+    wakeup(&p->nwrite);  //DOC: piperead-wakeup
   }
-  wakeup(&p->nwrite);  //DOC: piperead-wakeup
   release(&p->lock);
   return i;
 }
@@ -0,0 +1,57 @@
+// Measure pipe bandwidth.
+// A child writes MB megabytes into a pipe in chunks of
+// the given size (default 4096 bytes) and the parent reads
+// them back; prints ticks and KB per tick.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define MB     8
+#define MAXBUF 16384
+
+char buf[MAXBUF];
+
+int
+main(int argc, char *argv[])
+{
+  int fds[2], chunk, total, n, got, t0, t1;
+
+  chunk = 4096;
+  if(argc > 1)
+    chunk = atoi(argv[1]);
+  if(chunk < 1 || chunk > MAXBUF){
+    printf(2, "usage: pipebench [chunk (1-%d)]\n", MAXBUF);
+    exit();
+  }
+  total = MB*1024*1024;
+
+  if(pipe(fds) < 0){
+    printf(2, "pipebench: pipe failed\n");
+    exit();
+  }
+
+  t0 = uptime();
+  if(fork() == 0){
+    close(fds[0]);
+    for(n = 0; n < total; n += chunk)
+      if(write(fds[1], buf, chunk) != chunk){
+        printf(2, "pipebench: write failed\n");
+        break;
+      }
+    exit();
+  }
+  close(fds[1]);
+  got = 0;
+  while((n = read(fds[0], buf, chunk)) > 0)
+    got += n;
+  close(fds[0]);
+  wait();
+  t1 = uptime();
+
+  if(t1 == t0)
+    t1++;
+  printf(1, "pipebench: %d bytes in %d-byte chunks, %d ticks, %d KB/tick\n",
+         got, chunk, t1-t0, got/1024/(t1-t0));
+  exit();
+}
@@ -4,26 +4,87 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
-#include "proc.h"
 #include "spinlock.h"
-
+#include "proc.h"
+#include "slab.h"
+
+// ptable.lock protects the list of processes and the
+// parent/child links that exit and wait follow.  Procs come
+// from a slab cache, so their number is only limited by memory.  Scheduling
+// uses finer locks:
+//
+// * Each CPU has a run queue of RUNNABLE processes.  Its lock
+//   is held across every context switch between that CPU's
+//   scheduler and a process, so a process that is switching
+//   out can not be picked up by another CPU until its context
+//   has been saved.
+// * Sleeping processes hang off one of NSLEEPQ wait queues,
+//   hashed by channel, so wakeup only looks at processes that
+//   may be sleeping on its channel.
+// * A woken process goes back on the run queue of the CPU it
+//   last ran on (p->cpu).  If it is still switching out there,
+//   the waker spins on that run queue lock until it is done.
+// * An idle CPU steals processes from other CPUs' run queues.
+//
+// Each run queue is a multilevel feedback queue with NPRIO
+// levels, 0 the highest.  The scheduler runs the first process
+// of the highest non-empty level.  A process at level l gets a
+// slice of QUANTUM<<l ticks; if it uses the slice up it drops a
+// level, while one that sleeps first keeps its level, so
+// interactive processes stay above CPU hogs.  Every BOOSTTICKS
+// ticks processes return to their base level (p->nice, set by
+// setpriority) so that nothing starves.  A process is preempted
+// when its slice runs out or a higher level has work waiting.
+//
+// Lock order: ptable.lock, then a sleep queue, then a run queue.
 struct {
   struct spinlock lock;
-  struct proc proc[NPROC];
+  struct proc *list;    // every proc, through p->next
+  struct kmcache cache;
 } ptable;
 
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];  // next to run at each level
+  struct proc *tail[NPRIO];
+  int n;
+  uint nextboost;     // ticks at which to boost queued processes
+
+  // Statistics, protected by lock.
+  uint nswitch;       // processes started by the scheduler
+  uint nsteal;        // ... taken from another CPU's queue
+  uint latsum;        // total RUNNABLE to RUNNING delay, in 1024-cycle units
+  uint latmax;        // largest such delay
+};
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+};
+
+static struct runq runq[NCPU];
+static struct sleepq sleepq[NSLEEPQ];
+static struct spinlock futexlock;
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
-
-static void wakeup1(void *chan);
+static void unsleep(struct proc*);
 
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  kmcinit(&ptable.cache, "proc", sizeof(struct proc));
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  initlock(&futexlock, "futex");
 }
 
 // Must be called with interrupts disabled
@@ -65,9 +126,126 @@ myproc(void) {
   return p;
 }
 
+// This CPU's run queue.  Must be called with interrupts disabled.
+static struct runq*
+myrunq(void)
+{
+  return &runq[cpuid()];
+}
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[((uint)chan >> 2) % NSLEEPQ];
+}
+
+// Caller holds rq->lock.  Reads p->level only once, since
+// setpriority may change it without holding rq->lock.
+static void
+rqappend(struct runq *rq, struct proc *p)
+{
+  int l;
+
+  l = p->level;
+  p->qnext = 0;
+  if(rq->tail[l])
+    rq->tail[l]->qnext = p;
+  else
+    rq->head[l] = p;
+  rq->tail[l] = p;
+}
+
+// Append p to run queue rq at its priority level, first
+// returning it to its base level if it has gone a full
+// BOOSTTICKS without a boost.  Caller holds rq->lock.
+static void
+rqpush(struct runq *rq, struct proc *p)
+{
+  if(ticks - p->boosttick >= BOOSTTICKS){
+    p->boosttick = ticks;
+    p->level = p->nice;
+    p->slice = 0;
+  }
+  rqappend(rq, p);
+  rq->n++;
+  p->readytime = rdtsc();
+  p->readytick = ticks;
+}
+
+// Remove and return the first process of the highest
+// non-empty level of rq, or 0.  Caller holds rq->lock.
+static struct proc*
+rqpop(struct runq *rq)
+{
+  struct proc *p;
+  int l;
+
+  for(l = 0; l < NPRIO; l++){
+    if((p = rq->head[l]) != 0){
+      rq->head[l] = p->qnext;
+      if(rq->head[l] == 0)
+        rq->tail[l] = 0;
+      rq->n--;
+      p->qnext = 0;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Move every process queued on rq back to its base level.
+// Caller holds rq->lock.
+static void
+rqboost(struct runq *rq)
+{
+  struct proc *p, *list;
+  int l;
+
+  for(l = 1; l < NPRIO; l++){
+    list = rq->head[l];
+    rq->head[l] = rq->tail[l] = 0;
+    while((p = list) != 0){
+      list = p->qnext;
+      p->boosttick = ticks;
+      p->level = p->nice;
+      p->slice = 0;
+      rqappend(rq, p);
+    }
+  }
+}
+
+// Mark p RUNNABLE and queue it on the run queue of p->cpu.
+static void
+makerunnable(struct proc *p)
+{
+  struct runq *rq;
+
+  rq = &runq[p->cpu];
+  acquire(&rq->lock);
+  p->state = RUNNABLE;
+  rqpush(rq, p);
+  release(&rq->lock);
+}
+
+// Unlink p from the process list and free it and its
+// kernel stack.  Caller holds ptable.lock.
+static void
+freeproc(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &ptable.list; *pp != p; pp = &(*pp)->next)
+    ;
+  *pp = p->next;
+  if(p->kstack)
+    kfree(p->kstack);
+  droplock(&p->glock);
+  kmcfree(&ptable.cache, p);
+}
+
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
+// Allocate a proc and add it to the process list.
+// If that works, set its state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
 static struct proc*
@@ -76,24 +254,34 @@ allocproc(void)
   struct proc *p;
   char *sp;
 
-  acquire(&ptable.lock);
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
+  if((p = kmcalloc(&ptable.cache)) == 0)
+    return 0;
+  memset(p, 0, sizeof(*p));
+  p->state = EMBRYO;
+  p->group = p;
+  initlock(&p->glock, "group");
 
+  acquire(&ptable.lock);
+  p->pid = nextpid++;
+  p->next = ptable.list;
+  ptable.list = p;
   release(&ptable.lock);
-  return 0;
 
-found:
-  p->state = EMBRYO;
-  p->pid = nextpid++;
+  // Start out on the run queue of the creating CPU.
+  pushcli();
+  p->cpu = cpuid();
+  popcli();
 
-  release(&ptable.lock);
+  p->nice = p->level = 0;
+  p->slice = 0;
+  p->boosttick = ticks;
+  p->rticks = p->wticks = 0;
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+    acquire(&ptable.lock);
+    freeproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -149,15 +337,9 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  // this assignment to p->state lets other cores
-  // run this process. the acquire forces the above
-  // writes to be visible, and the lock is also needed
-  // because the assignment might not be atomic.
-  acquire(&ptable.lock);
-
-  p->state = RUNNABLE;
-
-  release(&ptable.lock);
+  // this lets other cores run this process. the run
+  // queue lock forces the above writes to be visible.
+  makerunnable(p);
 }
 
 // Grow current process's memory by n bytes.
@@ -168,19 +350,102 @@ growproc(int n)
   uint sz;
   struct proc *curproc = myproc();
 
+  vmlock(curproc);
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n > vmalimit(curproc->group) || sz + n < sz ||
+       (sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0){
+      vmunlock(curproc);
       return -1;
+    }
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0){
+      vmunlock(curproc);
       return -1;
+    }
   }
-  curproc->sz = sz;
+  setsz(curproc, sz);
+  vmunlock(curproc);
   switchuvm(curproc);
   return 0;
 }
 
+// Threads share one address space, whose mmap regions are
+// kept by the thread group leader (p->group).  vmlock makes
+// changes to it one at a time: sbrk, mmap, munmap, fork and
+// page faults.  It is a sleep lock on the leader's vmbusy,
+// guarded by the leader's glock, so that unrelated processes
+// never wait for each other.
+void
+vmlock(struct proc *p)
+{
+  p = p->group;
+  acquire(&p->glock);
+  while(p->vmbusy)
+    sleep(&p->vmbusy, &p->glock);
+  p->vmbusy = 1;
+  release(&p->glock);
+}
+
+void
+vmunlock(struct proc *p)
+{
+  p = p->group;
+  acquire(&p->glock);
+  p->vmbusy = 0;
+  wakeup(&p->vmbusy);
+  release(&p->glock);
+}
+
+// Set the memory size of every thread sharing p's address space.
+void
+setsz(struct proc *p, uint sz)
+{
+  struct proc *q;
+
+  acquire(&ptable.lock);
+  for(q = ptable.list; q; q = q->next)
+    if(q->group == p->group)
+      q->sz = sz;
+  release(&ptable.lock);
+}
+
+// Does p share its address space with another live thread?
+int
+threaded(struct proc *p)
+{
+  struct proc *q;
+  int r;
+
+  r = 0;
+  acquire(&ptable.lock);
+  for(q = ptable.list; q; q = q->next)
+    if(q != p && q->group == p->group && q->state != ZOMBIE)
+      r = 1;
+  release(&ptable.lock);
+  return r;
+}
+
+// Does [start, end) overlap a block that a system call of one
+// of p's threads has pinned (see argptr)?  The caller holds
+// vmlock, so no block can be pinned meanwhile.
+int
+vmpinned(struct proc *p, uint start, uint end)
+{
+  struct proc *q;
+  int r;
+
+  if(p->group->nthread == 0)
+    return 0;  // the caller is the only thread, and pins nothing
+  r = 0;
+  acquire(&ptable.lock);
+  for(q = ptable.list; q; q = q->next)
+    if(q->group == p->group && q->pinend > start && q->pinstart < end)
+      r = 1;
+  release(&ptable.lock);
+  return r;
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
@@ -188,7 +453,7 @@ int
 fork(void)
 {
   int i, pid;
-  struct proc *np;
+  struct proc *np, *g;
   struct proc *curproc = myproc();
 
   // Allocate process.
@@ -197,10 +462,15 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+  vmlock(curproc);
+  if((np->pgdir = copyuvm(curproc)) == 0 ||
+     vmacopy(np->pgdir, curproc->group) < 0){
+    vmunlock(curproc);
+    if(np->pgdir)
+      freevm(np->pgdir);
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
     return -1;
   }
   np->sz = curproc->sz;
@@ -210,22 +480,152 @@ fork(void)
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
+  g = curproc->group;
+  acquire(&g->glock);
   for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+    if(g->ofile[i])
+      np->ofile[i] = filedup(g->ofile[i]);
+  np->cwd = idup(g->cwd);
+  release(&g->glock);
+  vmadup(np, g);
+  vmunlock(curproc);
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
+  // The child inherits its parent's base priority.
+  np->nice = np->level = curproc->nice;
+
   pid = np->pid;
 
-  acquire(&ptable.lock);
+  makerunnable(np);
+
+  return pid;
+}
 
-  np->state = RUNNABLE;
+// Create a thread: a process sharing the caller's page table,
+// open files and cwd, that starts at fcn(arg1, arg2) on the
+// one-page user stack at stack.  The caller can join it.
+// The group leader keeps the shared state; threads use it
+// through p->group.
+int
+clone(void (*fcn)(void*, void*), void *arg1, void *arg2, void *stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *curproc = myproc();
+  uint sp, ustack[3];
+
+  if((uint)stack % PGSIZE != 0)
+    return -1;
+  if((np = allocproc()) == 0)
+    return -1;
+
+  sp = (uint)stack + PGSIZE;
+  ustack[0] = 0xffffffff;  // fake return PC
+  ustack[1] = (uint)arg1;
+  ustack[2] = (uint)arg2;
+  sp -= sizeof(ustack);
+  if(copyout(curproc->pgdir, sp, ustack, sizeof(ustack)) < 0)
+    goto bad;
+
+  np->pgdir = curproc->pgdir;
+  np->sz = curproc->sz;
+  np->parent = curproc;
+  np->ustack = stack;
+  *np->tf = *curproc->tf;
+  np->tf->eip = (uint)fcn;
+  np->tf->esp = sp;
 
+  // Join the group under ptable.lock, so that a leader busy
+  // exiting either sees the new thread or has already
+  // killed this one (see killthreads).
+  acquire(&ptable.lock);
+  np->group = curproc->group;
+  if(curproc->killed){
+    np->group = np;
+    release(&ptable.lock);
+    goto bad;
+  }
+  np->group->nthread++;
   release(&ptable.lock);
 
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+  np->nice = np->level = curproc->nice;
+
+  pid = np->pid;
+  makerunnable(np);
   return pid;
+
+bad:
+  acquire(&ptable.lock);
+  freeproc(np);
+  release(&ptable.lock);
+  return -1;
+}
+
+// Wait for a thread made by clone to exit, and return its
+// pid and, in *stack, the user stack it was given.
+// Return -1 if this process has no such threads.
+int
+join(void **stack)
+{
+  struct proc *p;
+  int havekids, pid;
+  void *ustack;
+  struct proc *curproc = myproc();
+
+  acquire(&ptable.lock);
+  for(;;){
+    havekids = 0;
+    for(p = ptable.list; p; p = p->next){
+      if(p->parent != curproc || p->group != curproc->group)
+        continue;
+      havekids = 1;
+      if(p->state == ZOMBIE){
+        // The page table belongs to the group.
+        pid = p->pid;
+        ustack = p->ustack;
+        curproc->cnsyscall += p->nsyscall + p->cnsyscall;
+        freeproc(p);
+        release(&ptable.lock);
+        *stack = ustack;
+        return pid;
+      }
+    }
+
+    if(!havekids || curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+    sleep(curproc, &ptable.lock);
+  }
+}
+
+// Kill the other threads of g's group and wait until they
+// have all exited, so that the leader g can free the
+// address space they share.
+static void
+killthreads(struct proc *g)
+{
+  struct proc *p;
+  int n;
+
+  acquire(&ptable.lock);
+  for(;;){
+    n = 0;
+    for(p = ptable.list; p; p = p->next){
+      if(p == g || p->group != g || p->state == ZOMBIE)
+        continue;
+      p->killed = 1;
+      if(p->state == SLEEPING)
+        unsleep(p);
+      n++;
+    }
+    if(n == 0)
+      break;
+    sleep(g, &ptable.lock);  // see wakeup in exit
+  }
+  release(&ptable.lock);
 }
 
 // Exit the current process.  Does not return.
@@ -241,34 +641,55 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
+  // The leader outlives its threads, so it alone closes the
+  // files and cwd they share.
+  if(curproc->group == curproc){
+    killthreads(curproc);
+
+    // Close all open files.
+    for(fd = 0; fd < NOFILE; fd++){
+      if(curproc->ofile[fd]){
+        fileclose(curproc->ofile[fd]);
+        curproc->ofile[fd] = 0;
+      }
     }
   }
 
+  // exit() from inside a system call skips its unpinning.
+  curproc->pinend = 0;
+
+  // Write back and drop mmap regions, then exec segments.
+  vmaunmap(curproc, 0, KERNBASE);
   begin_op();
-  iput(curproc->cwd);
+  if(curproc->cwd)
+    iput(curproc->cwd);
+  vmaclear(curproc);
   end_op();
   curproc->cwd = 0;
 
   acquire(&ptable.lock);
+  if(curproc->group != curproc)
+    curproc->group->nthread--;
 
-  // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  // Parent might be sleeping in wait() or join(), and
+  // the group leader in killthreads().
+  wakeup(curproc->parent);
+  if(curproc->group != curproc)
+    wakeup(curproc->group);
 
   // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  for(p = ptable.list; p; p = p->next){
     if(p->parent == curproc){
       p->parent = initproc;
       if(p->state == ZOMBIE)
-        wakeup1(initproc);
+        wakeup(initproc);
     }
   }
 
-  // Jump into the scheduler, never to return.
+  // Jump into the scheduler, never to return.  Keep holding
+  // ptable.lock until the scheduler is off our kernel stack,
+  // so that wait() in the parent cannot free it under us.
+  acquire(&myrunq()->lock);
   curproc->state = ZOMBIE;
   sched();
   panic("zombie exit");
@@ -287,21 +708,19 @@ wait(void)
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+    for(p = ptable.list; p; p = p->next){
+      // Our own threads are for join.
+      if(p->parent != curproc || p->group == curproc->group)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
-        // Found one.
+        // Found one.  An orphaned thread's page table
+        // belongs to its group leader.
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
+        curproc->cnsyscall += p->nsyscall + p->cnsyscall;
+        if(p->group == p)
+          freevm(p->pgdir);
+        freeproc(p);
         release(&ptable.lock);
         return pid;
       }
@@ -313,16 +732,41 @@ wait(void)
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
+    // Wait for children to exit.  (See wakeup call in proc_exit.)
     sleep(curproc, &ptable.lock);  //DOC: wait-sleep
   }
 }
 
+// Take a process off another CPU's run queue, for an idle CPU.
+// Called without rq->lock held, so that two idle CPUs stealing
+// from each other cannot deadlock.  A process on a run queue
+// is not running anywhere, so the thief may run it at once.
+static struct proc*
+rqsteal(struct runq *rq)
+{
+  struct runq *victim;
+  struct proc *p;
+  int i;
+
+  for(i = 1; i < ncpu; i++){
+    victim = &runq[(rq - runq + i) % ncpu];
+    if(victim->n == 0)
+      continue;
+    acquire(&victim->lock);
+    p = rqpop(victim);
+    release(&victim->lock);
+    if(p)
+      return p;
+  }
+  return 0;
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - choose a process to run from this CPU's run queue,
+//      or steal one from another CPU if the queue is empty
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -331,39 +775,65 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *rq = myrunq();
+  int stolen, zombie;
+  uint lat;
+
   c->proc = 0;
 
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
+    acquire(&rq->lock);
+    if(ticks >= rq->nextboost){
+      rqboost(rq);
+      rq->nextboost = ticks + BOOSTTICKS;
+    }
+    stolen = 0;
+    if((p = rqpop(rq)) == 0){
+      release(&rq->lock);
+      if((p = rqsteal(rq)) == 0)
         continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+      stolen = 1;
+      acquire(&rq->lock);
     }
-    release(&ptable.lock);
 
+    lat = (rdtsc() - p->readytime) >> 10;
+    rq->nswitch++;
+    rq->nsteal += stolen;
+    rq->latsum += lat;
+    if(lat > rq->latmax)
+      rq->latmax = lat;
+    p->wticks += ticks - p->readytick;
+    if(p->slice <= 0)
+      p->slice = QUANTUM << p->level;
+
+    // Switch to chosen process.  It is the process's job
+    // to release rq->lock and then reacquire it
+    // before jumping back to us.
+    p->cpu = c - cpus;
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
+
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    // An exiting process also left ptable.lock for us to drop.
+    zombie = p->state == ZOMBIE;
+    c->proc = 0;
+    if(zombie)
+      release(&ptable.lock);
+    release(&rq->lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
+// Enter scheduler.  Must hold only this CPU's run queue lock
+// (and ptable.lock, when exiting) and have changed proc->state.
+// Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->ncli, but that would
@@ -375,10 +845,10 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
-  // 除ptable.lock外,不允许持有其他spinlock
-  if(mycpu()->ncli != 1)
+  if(!holding(&myrunq()->lock))
+    panic("sched runq lock");
+  // 除run queue lock(exit时还有ptable.lock)外,不允许持有其他spinlock
+  if(mycpu()->ncli != (p->state == ZOMBIE ? 2 : 1))
     panic("sched locks");
   if(p->state == RUNNING)
     panic("sched running");
@@ -393,10 +863,86 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+  struct runq *rq;
+
+  pushcli();
+  rq = myrunq();
+  acquire(&rq->lock);  //DOC: yieldlock
+  popcli();
+  p->state = RUNNABLE;
+  rqpush(rq, p);
   sched();
+  // We may have been stolen by another CPU meanwhile.
+  release(&myrunq()->lock);
+}
+
+// Charge the running process for a timer tick.  Returns 1 if
+// it should yield: its slice is used up, so it also drops a
+// level, or a higher level has a process waiting on this CPU.
+int
+schedtick(void)
+{
+  struct proc *p;
+  struct runq *rq;
+  int l, r;
+
+  pushcli();
+  p = myproc();
+  rq = myrunq();
+  p->rticks++;
+  r = 0;
+  if(--p->slice <= 0){
+    if(p->level < NPRIO-1)
+      p->level++;
+    r = 1;
+  }
+  for(l = 0; l < p->level && !r; l++)
+    if(rq->head[l])  // no lock: a stale answer costs one tick
+      r = 1;
+  popcli();
+  return r;
+}
+
+// Set the base priority level of process pid.
+int
+setpriority(int pid, int nice)
+{
+  struct proc *p;
+
+  if(nice < 0 || nice >= NPRIO)
+    return -1;
+  acquire(&ptable.lock);
+  for(p = ptable.list; p; p = p->next){
+    if(p->pid == pid){
+      p->nice = nice;
+      if(p->level < nice)
+        p->level = nice;
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+// Return the base priority level of process pid.
+int
+getpriority(int pid)
+{
+  struct proc *p;
+  int nice;
+
+  acquire(&ptable.lock);
+  for(p = ptable.list; p; p = p->next){
+    if(p->pid == pid){
+      nice = p->nice;
+      release(&ptable.lock);
+      return nice;
+    }
+  }
   release(&ptable.lock);
+  return -1;
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -405,8 +951,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding the run queue lock from scheduler.
+  release(&myrunq()->lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -415,6 +961,7 @@ forkret(void)
     first = 0;
     iinit(ROOTDEV);
     initlog(ROOTDEV);
+    fsallocinit(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -426,6 +973,8 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq;
+  struct runq *rq;
 
   if(p == 0)
     panic("sleep");
@@ -433,52 +982,136 @@ sleep(void *chan, struct spinlock *lk)
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
+  // Must acquire chan's sleep queue lock in order to
+  // change p->state and queue p.
+  // Once we hold it, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // (wakeup runs with the sleep queue locked),
   // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
-  }
+  sq = chanq(chan);
+  acquire(&sq->lock);  //DOC: sleeplock1
+  release(lk);
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
-
+  p->qnext = sq->head;
+  sq->head = p;
+
+  // A waker queues p on this CPU's run queue, whose lock
+  // we hold until the scheduler is off our stack.
+  rq = myrunq();
+  acquire(&rq->lock);
+  release(&sq->lock);
   sched();
-
-  // Tidy up.
-  p->chan = 0;
+  release(&myrunq()->lock);
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  acquire(lk);  //DOC: sleeplock2
 }
 
 //PAGEBREAK!
-// Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-static void
-wakeup1(void *chan)
+// Wake up at most n processes sleeping on chan, or all of
+// them if n < 0.  Returns how many were woken.
+static int
+wakeupn(void *chan, int n)
 {
-  struct proc *p;
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  struct sleepq *sq;
+  struct proc *p, **pp;
+  int woken;
+
+  woken = 0;
+  sq = chanq(chan);
+  acquire(&sq->lock);
+  for(pp = &sq->head; (p = *pp) != 0 && woken != n; ){
+    if(p->chan == chan){
+      *pp = p->qnext;
+      p->chan = 0;
+      makerunnable(p);
+      woken++;
+    } else
+      pp = &p->qnext;
+  }
+  release(&sq->lock);
+  return woken;
 }
 
 // Wake up all processes sleeping on chan.
 void
 wakeup(void *chan)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  wakeupn(chan, -1);
+}
+
+// Wake p from whatever it is sleeping on.  Caller holds
+// ptable.lock, so that p cannot be freed.  p->chan changes under
+// the lock of the sleep queue p is on, so the chan read first is
+// only a guess at that queue: check it under the queue's lock,
+// and if p has since woken and gone to sleep on another channel,
+// try again rather than lose the wakeup.
+static void
+unsleep(struct proc *p)
+{
+  struct sleepq *sq;
+  struct proc **pp;
+  void *chan;
+
+  if(!holding(&ptable.lock))
+    panic("unsleep");
+  for(;;){
+    if((chan = p->chan) == 0)
+      return;  // awake; it checks p->killed before user space
+    sq = chanq(chan);
+    acquire(&sq->lock);
+    if(p->chan == chan){
+      if(p->state == SLEEPING){
+        for(pp = &sq->head; *pp != p; pp = &(*pp)->qnext)
+          ;
+        *pp = p->qnext;
+        p->chan = 0;
+        makerunnable(p);
+      }
+      release(&sq->lock);
+      return;
+    }
+    release(&sq->lock);
+  }
+}
+
+// Sleep on the user word at addr if it still holds val.
+// Waiters are keyed by the kernel address of the word, so
+// threads sharing a page table and processes sharing a
+// MAP_SHARED page meet on the same key.  Returns -1 at once
+// if the word has changed.  addr must be mapped.
+int
+futexwait(int *addr, int val)
+{
+  int *k;
+
+  if((k = (int*)uva2kaw(myproc()->pgdir, (uint)addr)) == 0)
+    return -1;
+  acquire(&futexlock);
+  if(*k != val || myproc()->killed){
+    release(&futexlock);
+    return -1;
+  }
+  sleep(k, &futexlock);
+  release(&futexlock);
+  return 0;
+}
+
+// Wake at most n processes waiting on the word at addr.
+int
+futexwake(int *addr, int n)
+{
+  int *k, r;
+
+  if((k = (int*)uva2kaw(myproc()->pgdir, (uint)addr)) == 0)
+    return -1;
+  acquire(&futexlock);
+  r = wakeupn(k, n);
+  release(&futexlock);
+  return r;
 }
 
 // Kill the process with the given pid.
@@ -490,12 +1123,12 @@ kill(int pid)
   struct proc *p;
 
   acquire(&ptable.lock);
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  for(p = ptable.list; p; p = p->next){
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        unsleep(p);
       release(&ptable.lock);
       return 0;
     }
@@ -524,14 +1157,13 @@ procdump(void)
   char *state;
   uint pc[10];
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
+  for(p = ptable.list; p; p = p->next){
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
+    cprintf("%d %s %s level %d nice %d run %d wait %d", p->pid, state,
+            p->name, p->level, p->nice, p->rticks, p->wticks);
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
@@ -539,4 +1171,11 @@ procdump(void)
     }
     cprintf("\n");
   }
+  for(i = 0; i < ncpu; i++)
+    cprintf("cpu%d: runq %d switch %d steal %d latency avg %d max %d kcycles\n",
+            i, runq[i].n, runq[i].nswitch, runq[i].nsteal,
+            runq[i].nswitch ? runq[i].latsum / runq[i].nswitch : 0,
+            runq[i].latmax);
+  kallocdump();
+  kmcdump();
 }
@@ -8,6 +8,7 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  volatile uint tlbgen;        // TLB shootdowns taken (see tlbflush)
 };
 
 extern struct cpu cpus[NCPU];
@@ -34,6 +35,23 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory whose pages are filled in on first
+// touch (see vmfault).  Page start+i holds file bytes off+i,
+// up to filesz; the rest of the region is zero.  Anonymous
+// regions have no ip and filesz 0.
+struct vma {
+  uint start;                  // Page-aligned; 0 to end if unused
+  uint end;
+  struct inode *ip;
+  uint off;
+  uint filesz;
+  int flags;                   // VMA_*
+};
+
+#define VMA_WRITE  0x1         // process may write (copy-on-write unless shared)
+#define VMA_SHARED 0x2         // writes go to the file and are seen after fork
+#define VMA_MMAP   0x4         // made by mmap, above sz; else an exec segment
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -41,13 +59,34 @@ struct proc {
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
+  struct proc *next;           // On ptable.list
   struct proc *parent;         // Parent process
+  struct proc *group;          // Thread group leader, which owns vma; itself if not a thread
+  void *ustack;                // User stack passed to clone, for join
+  struct spinlock glock;       // Leader only: protects vmbusy, ofile and cwd
+  int vmbusy;                  // Leader only: address space being changed (see vmlock)
+  int nthread;                 // Leader only: live threads besides itself
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
+  int cpu;                     // CPU that last ran it; its run queue
+  struct proc *qnext;          // Run queue or sleep queue link
+  uint readytime;              // rdtsc() when queued to run
+  int nice;                    // Base priority level, 0 highest
+  int level;                   // Current priority level, >= nice
+  int slice;                   // Ticks left at this level
+  uint boosttick;              // ticks at last priority boost
+  uint readytick;              // ticks when queued to run
+  uint rticks;                 // Ticks spent running
+  uint wticks;                 // Ticks spent runnable but waiting
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  uint nsyscall;               // System calls made
+  uint cnsyscall;              // ... by reaped children and threads
+  uint pinstart;               // User block the current system call
+  uint pinend;                 //   uses, if pinend != 0 (see argptr)
+  struct file *ofile[NOFILE];  // Leader only: open files, shared by its threads
+  struct inode *cwd;           // Leader only: current directory, likewise
+  struct vma vma[NVMA];        // Demand-paged regions
   char name[16];               // Process name (debugging)
   int alarmticks;              // System Call alarm setting
   void (*alarmhandler)();      // System Call alarm setting
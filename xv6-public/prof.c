@@ -0,0 +1,242 @@
+// Profile a command with the kernel's sampling profiler.
+//
+//   prof [-r rate] cmd [arg...]
+//
+// Runs cmd with the profiler taking rate samples per clock tick
+// on every CPU (default 4, at most PROFMAXRATE), then prints a
+// flat profile: samples per function, most first.  Kernel
+// addresses are looked up in /kernel.sym and user addresses of
+// cmd's process in /cmd.sym (the Makefile puts both in fs.img,
+// cutting cmd to SYMNAME characters so the name fits DIRSIZ).
+// User samples of other processes count as "(other process)".
+//
+// A second thread drains the kernel's sample rings every tick
+// while cmd runs, so that they do not overflow.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "profile.h"
+#include "fs.h"
+
+#define NREAD 256   // samples per profread
+#define SYMNAME (DIRSIZ - 4)  // characters of cmd in its symbol file name
+
+struct sym {
+  uint addr;
+  char *name;
+  uint count;
+};
+
+struct symtab {
+  struct sym *sym;
+  int n;
+};
+
+struct symtab ksyms, usyms;
+struct profsample buf[NREAD];
+int cmdpid;
+uint nsample, nother, nunknown;
+volatile int done;
+
+uint
+hex(char *s)
+{
+  uint v;
+
+  v = 0;
+  for(;; s++){
+    if(*s >= '0' && *s <= '9')
+      v = v*16 + *s - '0';
+    else if(*s >= 'a' && *s <= 'f')
+      v = v*16 + *s - 'a' + 10;
+    else
+      return v;
+  }
+}
+
+// Load a symbol file made by the Makefile ("addr name" lines),
+// keeping the symbols with an address, sorted by address.
+int
+loadsyms(char *file, struct symtab *t)
+{
+  struct stat st;
+  struct sym x;
+  char *text, *p, *q;
+  int fd, n, i, j, gap;
+
+  t->n = 0;
+  if((fd = open(file, O_RDONLY)) < 0)
+    return -1;
+  if(fstat(fd, &st) < 0 || (text = malloc(st.size + 1)) == 0){
+    close(fd);
+    return -1;
+  }
+  n = read(fd, text, st.size);
+  close(fd);
+  if(n < 0)
+    return -1;
+  text[n] = 0;
+
+  n = 0;
+  for(p = text; *p; p++)
+    if(*p == '\n')
+      n++;
+  if((t->sym = malloc(n * sizeof(struct sym))) == 0)
+    return -1;
+  for(p = text; *p; p = q + 1){
+    if((q = strchr(p, '\n')) == 0)
+      break;
+    *q = 0;
+    x.addr = hex(p);
+    if(x.addr != 0 && strchr(p, ' ') != 0){
+      x.name = strchr(p, ' ') + 1;
+      x.count = 0;
+      t->sym[t->n++] = x;
+    }
+  }
+
+  // Shell sort by address.
+  for(gap = t->n/2; gap > 0; gap /= 2)
+    for(i = gap; i < t->n; i++){
+      x = t->sym[i];
+      for(j = i; j >= gap && t->sym[j-gap].addr > x.addr; j -= gap)
+        t->sym[j] = t->sym[j-gap];
+      t->sym[j] = x;
+    }
+  return 0;
+}
+
+// The symbol pc falls in: the last one at or below it.
+struct sym*
+lookup(struct symtab *t, uint pc)
+{
+  int lo, hi, mid;
+
+  if(t->n == 0 || pc < t->sym[0].addr)
+    return 0;
+  lo = 0;
+  hi = t->n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(t->sym[mid].addr <= pc)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &t->sym[lo];
+}
+
+void
+tally(struct profsample *s, int n)
+{
+  struct sym *sym;
+  int i;
+
+  for(i = 0; i < n; i++, s++){
+    nsample++;
+    if(s->user && s->pid != cmdpid){
+      nother++;
+      continue;
+    }
+    if((sym = lookup(s->user ? &usyms : &ksyms, s->pc)) != 0)
+      sym->count++;
+    else
+      nunknown++;
+  }
+}
+
+void
+drain(void *arg1, void *arg2)
+{
+  int n;
+
+  while(!done){
+    while((n = profread(buf, NREAD)) > 0)
+      tally(buf, n);
+    sleep(1);
+  }
+  exit();
+}
+
+void
+print(struct symtab *t, char *where)
+{
+  struct sym x;
+  int i, j;
+
+  // Insertion sort by count; few symbols have any.
+  for(i = 1; i < t->n; i++){
+    x = t->sym[i];
+    for(j = i; j > 0 && t->sym[j-1].count < x.count; j--)
+      t->sym[j] = t->sym[j-1];
+    t->sym[j] = x;
+  }
+  for(i = 0; i < t->n && t->sym[i].count > 0; i++)
+    printf(1, "%d %d%% %s %s\n", t->sym[i].count,
+           t->sym[i].count * 100 / nsample, where, t->sym[i].name);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *name, *p, symfile[32];
+  int rate, ndrop, n;
+
+  rate = 4;
+  if(argc > 2 && strcmp(argv[1], "-r") == 0){
+    rate = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || rate < 1 || rate > PROFMAXRATE){
+    printf(2, "usage: prof [-r rate] cmd [arg...]\n");
+    exit();
+  }
+
+  name = argv[1];
+  for(p = argv[1]; *p; p++)
+    if(*p == '/')
+      name = p + 1;
+  if((n = strlen(name)) > SYMNAME)
+    n = SYMNAME;
+  strcpy(symfile, "/");
+  memmove(symfile + 1, name, n);
+  strcpy(symfile + 1 + n, ".sym");
+  if(loadsyms("/kernel.sym", &ksyms) < 0)
+    printf(2, "prof: cannot read /kernel.sym\n");
+  if(loadsyms(symfile, &usyms) < 0)
+    printf(2, "prof: cannot read %s\n", symfile);
+
+  profile(rate);
+  if((cmdpid = fork()) == 0){
+    exec(argv[1], argv+1);
+    printf(2, "prof: exec %s failed\n", argv[1]);
+    exit();
+  }
+  if(cmdpid < 0 || kthread_create(drain, 0, 0) < 0){
+    printf(2, "prof: cannot start\n");
+    profile(0);
+    exit();
+  }
+  wait();
+  done = 1;
+  kthread_join();
+  ndrop = profile(0);
+  while((n = profread(buf, NREAD)) > 0)
+    tally(buf, n);
+
+  if(nsample == 0){
+    printf(1, "prof: no samples\n");
+    exit();
+  }
+  printf(1, "prof: %d samples, %d dropped\n", nsample, ndrop);
+  print(&ksyms, "kernel");
+  print(&usyms, name);
+  if(nother)
+    printf(1, "%d %d%% (other process)\n", nother, nother * 100 / nsample);
+  if(nunknown)
+    printf(1, "%d %d%% (unknown)\n", nunknown, nunknown * 100 / nsample);
+  exit();
+}
@@ -0,0 +1,130 @@
+// Sampling profiler.
+//
+// profile(rate) makes each CPU's timer interrupt rate times per
+// clock tick instead of once.  Every interrupt records where the
+// CPU was (pc, pid, user or kernel mode) in that CPU's ring of
+// NPROFBUF samples, and only every rate'th one counts as a
+// clock tick (see trap), so ticks, time slices and alarms keep
+// their length.  A CPU reprograms its own timer on its next
+// interrupt after the rate changes.
+//
+// profread copies samples out.  A ring that fills up before it
+// is read drops new samples, and counts them.  Each ring has a
+// single writer, its CPU's timer interrupt, and readers take
+// prof.lock, so head and tail need no other locking.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "x86.h"
+#include "sleeplock.h"
+#include "profile.h"
+
+#define NPROFBUF  512   // samples per CPU
+
+struct profcpu {
+  volatile uint head;   // samples written
+  volatile uint tail;   // samples read
+  uint ndrop;           // samples dropped, ring full
+  int rate;             // interrupts per tick the timer is set to
+  int n;                // interrupts since the last tick
+  struct profsample buf[NPROFBUF];
+} __attribute__((aligned(CACHELINE)));
+
+static struct {
+  struct sleeplock lock;  // readers; may fault on user memory
+  volatile int rate;      // samples per tick, 0 if off
+  struct profcpu cpu[NCPU];
+} prof;
+
+void
+profinit(void)
+{
+  initsleeplock(&prof.lock, "prof");
+}
+
+// Called on every timer interrupt, with interrupts off.
+// Takes a sample if the profiler is on, and returns 1 if this
+// interrupt is also a clock tick.
+int
+proftick(struct trapframe *tf)
+{
+  struct profcpu *pc;
+  struct profsample *s;
+  struct proc *p;
+  int rate;
+
+  pc = &prof.cpu[cpuid()];
+  rate = prof.rate ? prof.rate : 1;
+  if(pc->rate != rate){
+    lapictimer(rate);
+    pc->rate = rate;
+    pc->n = 0;
+  }
+
+  if(prof.rate){
+    if(pc->head - pc->tail < NPROFBUF){
+      s = &pc->buf[pc->head % NPROFBUF];
+      p = myproc();
+      s->pc = tf->eip;
+      s->pid = p ? p->pid : 0;
+      s->user = (tf->cs & 3) == DPL_USER;
+      __sync_synchronize();  // sample before head, for readers
+      pc->head++;
+    } else
+      pc->ndrop++;
+  }
+
+  if(++pc->n < rate)
+    return 0;
+  pc->n = 0;
+  return 1;
+}
+
+// Start the profiler at rate samples per tick, discarding
+// samples not yet read, or stop it if rate is 0.  Returns the
+// number of samples dropped since it was last started.
+int
+profile(int rate)
+{
+  struct profcpu *pc;
+  int ndrop;
+
+  if(rate < 0 || rate > PROFMAXRATE)
+    return -1;
+  acquiresleep(&prof.lock);
+  ndrop = 0;
+  for(pc = prof.cpu; pc < &prof.cpu[ncpu]; pc++){
+    ndrop += pc->ndrop;
+    if(rate > 0){
+      pc->tail = pc->head;
+      pc->ndrop = 0;
+    }
+  }
+  prof.rate = rate;
+  releasesleep(&prof.lock);
+  return ndrop;
+}
+
+// Copy up to n samples, from all CPUs, to dst.
+// Returns how many were copied.
+int
+profread(struct profsample *dst, int n)
+{
+  struct profcpu *pc;
+  int i;
+
+  i = 0;
+  acquiresleep(&prof.lock);
+  for(pc = prof.cpu; pc < &prof.cpu[ncpu]; pc++){
+    while(i < n && pc->tail != pc->head){
+      dst[i++] = pc->buf[pc->tail % NPROFBUF];
+      pc->tail++;
+    }
+  }
+  releasesleep(&prof.lock);
+  return i;
+}
@@ -0,0 +1,8 @@
+// Sampling profiler (see profile.c).
+#define PROFMAXRATE 16  // most samples per clock tick on each CPU
+
+struct profsample {
+  uint pc;              // %eip when the timer interrupted
+  int pid;              // process that was running, 0 if none
+  int user;             // interrupted in user mode?
+};
@@ -0,0 +1,69 @@
+// Measure context-switch rate and scheduling latency.
+// Starts npairs pairs of processes (default 4) that bounce a
+// byte back and forth through two pipes, so every round trip
+// is two sleeps, two wakeups and two context switches.
+// Run it with CPUS=8 and compare round trips per tick as the
+// number of pairs grows; ^P shows per-CPU switch counts,
+// steals and RUNNABLE-to-RUNNING latency.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define N 2000  // round trips per pair
+
+void
+pingpong(void)
+{
+  int ab[2], ba[2];
+  char c;
+  int i;
+
+  if(pipe(ab) < 0 || pipe(ba) < 0){
+    printf(1, "schedbench: pipe failed\n");
+    exit();
+  }
+  if(fork() == 0){
+    for(i = 0; i < N; i++){
+      if(read(ab[0], &c, 1) != 1)
+        break;
+      write(ba[1], &c, 1);
+    }
+    exit();
+  }
+  c = 'x';
+  for(i = 0; i < N; i++){
+    write(ab[1], &c, 1);
+    if(read(ba[0], &c, 1) != 1)
+      break;
+  }
+  wait();
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, npairs, t0, t1;
+
+  npairs = 4;
+  if(argc > 1)
+    npairs = atoi(argv[1]);
+  if(npairs < 1)
+    npairs = 1;
+
+  t0 = uptime();
+  for(i = 0; i < npairs; i++){
+    if(fork() == 0)
+      pingpong();
+  }
+  for(i = 0; i < npairs; i++)
+    wait();
+  t1 = uptime();
+
+  if(t1 == t0)
+    t1++;
+  printf(1, "schedbench: %d pairs x %d round trips, %d ticks, %d switches/tick\n",
+         npairs, N, t1-t0, 2*npairs*N/(t1-t0));
+  exit();
+}
@@ -0,0 +1,220 @@
+// Slab allocator for kernel objects smaller than a page.
+//
+// A kmcache hands out objects of one type.  It takes whole pages
+// from kalloc and carves each into a slab: a struct slab header
+// followed by as many objects as fit.  Objects are rounded up to
+// a multiple of CACHELINE bytes and start on a cache line, so two
+// objects never share a line and CPUs working on different ones
+// do not fight over it.  kmcfree finds an object's slab from its
+// address, by rounding down to the page.
+//
+// Free objects in a slab are linked through their first word.
+// Slabs sit on one of three lists of their cache: partial, full
+// or empty.  Allocation prefers partial slabs, so that live
+// objects stay packed into few pages; a slab that empties out
+// is kept for reuse, but only one per cache, the rest go back
+// to kalloc.
+//
+// In front of the slabs, each CPU keeps up to KMCPU objects it
+// freed recently and hands them out again first, without taking
+// the cache lock; they are likely still in its cache.  A CPU
+// with a full set passes half of them back to their slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "slab.h"
+
+struct slab {
+  struct kmcache *cache;
+  struct slab *next;     // on the cache's partial, full or empty list
+  struct slab *prev;
+  uint inuse;            // objects handed out
+  void *free;            // free objects
+};
+
+// Objects start on the first cache line past the header.
+#define SLABHDR     ((sizeof(struct slab) + CACHELINE-1) & ~(CACHELINE-1))
+#define SLABOBJ(s)  ((char*)(s) + SLABHDR)
+
+static struct {
+  struct spinlock lock;
+  struct kmcache *caches;
+} kmc;
+
+static void
+slabpush(struct slab **l, struct slab *s)
+{
+  s->prev = 0;
+  s->next = *l;
+  if(*l)
+    (*l)->prev = s;
+  *l = s;
+}
+
+static void
+slabremove(struct slab **l, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    *l = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+void
+slabinit(void)
+{
+  initlock(&kmc.lock, "kmc");
+}
+
+// Set up cache c for objects of size bytes.
+void
+kmcinit(struct kmcache *c, char *name, uint size)
+{
+  size = (size + CACHELINE-1) & ~(CACHELINE-1);
+  if(size > PGSIZE - SLABHDR)
+    panic("kmcinit: too big");
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+
+  acquire(&kmc.lock);
+  c->next = kmc.caches;
+  kmc.caches = c;
+  release(&kmc.lock);
+}
+
+// Take an object out of c's slabs, adding a slab if all are
+// full.  Caller holds c->lock.
+static void*
+slaballoc(struct kmcache *c)
+{
+  struct slab *s;
+  char *p;
+  void *obj;
+  uint i;
+
+  if((s = c->partial) == 0){
+    if((s = c->empty) != 0)
+      slabremove(&c->empty, s);
+    else {
+      if((s = (struct slab*)kalloc()) == 0)
+        return 0;
+      s->cache = c;
+      s->inuse = 0;
+      s->free = 0;
+      p = SLABOBJ(s) + c->perslab * c->size;
+      for(i = 0; i < c->perslab; i++){
+        p -= c->size;
+        *(void**)p = s->free;
+        s->free = p;
+      }
+      c->nslab++;
+    }
+    slabpush(&c->partial, s);
+  }
+
+  obj = s->free;
+  s->free = *(void**)obj;
+  if(++s->inuse == c->perslab){
+    slabremove(&c->partial, s);
+    slabpush(&c->full, s);
+  }
+  c->nobj++;
+  c->nalloc++;
+  return obj;
+}
+
+// Put obj back in its slab.  Caller holds c->lock.
+static void
+slabfree(struct kmcache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->cache != c)
+    panic("kmcfree: wrong cache");
+  if(s->inuse-- == c->perslab){
+    slabremove(&c->full, s);
+    slabpush(&c->partial, s);
+  }
+  *(void**)obj = s->free;
+  s->free = obj;
+  c->nobj--;
+  if(s->inuse == 0){
+    slabremove(&c->partial, s);
+    if(c->empty == 0)
+      slabpush(&c->empty, s);
+    else {
+      c->nslab--;
+      kfree((char*)s);
+    }
+  }
+}
+
+// Allocate an object from c.  Its contents are undefined.
+// Returns 0 if out of memory.
+void*
+kmcalloc(struct kmcache *c)
+{
+  void *obj;
+  int id;
+
+  pushcli();
+  id = cpuid();
+  if(c->cpu[id].n > 0){
+    obj = c->cpu[id].obj[--c->cpu[id].n];
+    popcli();
+    return obj;
+  }
+  popcli();
+
+  acquire(&c->lock);
+  obj = slaballoc(c);
+  release(&c->lock);
+  return obj;
+}
+
+// Free obj, which must have come from kmcalloc(c).
+void
+kmcfree(struct kmcache *c, void *obj)
+{
+  int id;
+
+  if((uint)obj % CACHELINE != 0)
+    panic("kmcfree");
+
+  pushcli();
+  id = cpuid();
+  if(c->cpu[id].n == KMCPU){
+    acquire(&c->lock);
+    while(c->cpu[id].n > KMCPU/2)
+      slabfree(c, c->cpu[id].obj[--c->cpu[id].n]);
+    release(&c->lock);
+  }
+  c->cpu[id].obj[c->cpu[id].n++] = obj;
+  popcli();
+}
+
+// Print slab statistics.  No lock, like kallocdump.
+void
+kmcdump(void)
+{
+  struct kmcache *c;
+  int i, ncached;
+
+  for(c = kmc.caches; c; c = c->next){
+    ncached = 0;
+    for(i = 0; i < ncpu; i++)
+      ncached += c->cpu[i].n;
+    cprintf("slab %s: %d bytes, %d/slab, %d slabs, %d in use, %d cached, alloc %d\n",
+            c->name, c->size, c->perslab, c->nslab,
+            c->nobj - ncached, ncached, c->nalloc);
+  }
+}
@@ -0,0 +1,30 @@
+// Object cache for kernel objects smaller than a page (see slab.c).
+// Needs param.h, mmu.h and spinlock.h.
+
+#define KMCPU  8     // freed objects each CPU keeps for reuse
+
+struct slab;
+
+struct kmcache {
+  struct spinlock lock;
+  char *name;
+  uint size;             // object size, a multiple of CACHELINE
+  uint perslab;          // objects per slab
+  struct slab *partial;  // slabs with some objects free
+  struct slab *full;     // slabs with none free
+  struct slab *empty;    // slabs with all free
+  struct kmcache *next;  // on the list of all caches
+
+  // Objects this CPU freed recently, reused first.
+  // Only touched by their own CPU, with interrupts off;
+  // a cache line each so that CPUs do not share them.
+  struct {
+    int n;
+    void *obj[KMCPU];
+  } __attribute__((aligned(CACHELINE))) cpu[NCPU];
+
+  // Statistics, protected by lock.
+  uint nslab;            // slabs held
+  uint nobj;             // objects out of slabs, per-CPU ones included
+  uint nalloc;           // objects handed out by slabs
+};
@@ -6,8 +6,272 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "proc.h"
+#include "lockstat.h"
+
+// Lock statistics.
+//
+// Locks are counted by class: all locks initialized with the
+// same name share one, so that, say, the NBUCKET bcache bucket
+// locks add up to a single line.  Each CPU has its own counters
+// for every class and only touches them while it holds (or is
+// acquiring) a lock of that class, with interrupts off, so
+// keeping count takes no atomic operations and no shared cache
+// lines.  getlockstat adds the CPUs' counters up.
+//
+// For each class a CPU also remembers the LSSITES callers of
+// acquire that most often had to wait; a new site replaces the
+// one seen least often.  Class 0 takes the names that come
+// once all NLOCKCLASS classes are in use.
+//
+// Locks made and freed all the time, such as those of inodes
+// and pipes, are initialized with the same string constant
+// each time, so initlock finds a name's class by the name's
+// address in a table read without locking, and only searches
+// the names the first time.  The number of live locks of a
+// class is counted per CPU like the rest; droplock takes a
+// freed lock off it.
+
+struct lockcount {
+  uint nacquire;
+  uint ncontend;
+  uint nspin;
+  unsigned long long hold;  // cycles
+  uint maxhold;
+  uint sitepc[LSSITES];
+  uint sitecnt[LSSITES];
+};
+
+#define NLSADDR 128  // name addresses remembered
+
+struct lsaddr {
+  char *volatile name;
+  volatile int cls;
+};
+
+static struct {
+  volatile uint lock;     // protects the class names; a bare xchg
+                          // lock, as initlock runs before mycpu() works
+  int ncls;
+  char *name[NLOCKCLASS];
+  struct lsaddr addr[NLSADDR];  // set once each, under lock
+  int nlock[NCPU][NLOCKCLASS];  // live locks, not reset
+  struct lockcount count[NCPU][NLOCKCLASS];
+} ls;
+
+// Find or make the class for locks called name.
+static int
+lockclass(char *name)
+{
+  struct lsaddr *a;
+  int i;
+
+  a = &ls.addr[((uint)name >> 2) % NLSADDR];
+  if(a->name == name)
+    return a->cls;
+
+  while(xchg(&ls.lock, 1) != 0)
+    ;
+  if(ls.ncls == 0){
+    ls.name[0] = "(other)";
+    ls.ncls = 1;
+  }
+  for(i = 1; i < ls.ncls; i++)
+    if(ls.name[i] == name || strncmp(ls.name[i], name, LSNAME) == 0)
+      break;
+  if(i == ls.ncls){
+    if(i < NLOCKCLASS)
+      ls.name[ls.ncls++] = name;
+    else
+      i = 0;
+  }
+  if(a->name == 0){
+    a->cls = i;
+    __sync_synchronize();  // cls before name, for readers without lock
+    a->name = name;
+  }
+  xchg(&ls.lock, 0);
+  return i;
+}
+
+// Add n to the live locks of class cls.
+static void
+countlock(int cls, int n)
+{
+  if(ncpu == 0){
+    // Early in boot: one CPU, and mycpu() does not work yet.
+    ls.nlock[0][cls] += n;
+    return;
+  }
+  pushcli();
+  ls.nlock[cpuid()][cls] += n;
+  popcli();
+}
+
+// Count a contended acquisition of lk, which spun n times,
+// against the caller of acquire.  Caller holds lk.
+static void
+lockcontend(struct spinlock *lk, uint n)
+{
+  struct lockcount *c;
+  int i, min;
+
+  c = &ls.count[lk->cpu - cpus][lk->cls];
+  c->ncontend++;
+  c->nspin += n;
+  min = 0;
+  for(i = 0; i < LSSITES; i++){
+    if(c->sitepc[i] == lk->pcs[0]){
+      c->sitecnt[i]++;
+      return;
+    }
+    if(c->sitecnt[i] < c->sitecnt[min])
+      min = i;
+  }
+  c->sitepc[min] = lk->pcs[0];
+  c->sitecnt[min] = 1;
+}
+
+//PAGEBREAK!
+// Lock implementations, chosen by LOCK in the Makefile.
+// lockwait(lk) returns once this CPU holds lk, with the number
+// of rounds it spun; lockhandoff(lk) lets the next CPU in.
+//
+// * TAS: a waiting CPU only reads lk->locked, which stays in
+//   its cache, until it sees 0; then it tries xchg.  After each
+//   failed xchg it pauses twice as long as before (up to
+//   MAXBACKOFF), so that fewer CPUs try at once.  Not fair.
+// * TICKET: a CPU takes a ticket with an atomic add and waits
+//   until lk->owner comes round to it, pausing longer the
+//   further back in line it is.  First come, first served, but
+//   every waiter still reads the one cache line that every
+//   release writes.
+// * MCS: a waiting CPU queues a node of its own on lk->tail and
+//   spins on that node; release hands the lock to the next node
+//   by writing only that node.  Fair, and release costs the same
+//   however many CPUs wait.  Each CPU has NMCSNODE nodes, one for
+//   each lock it can hold or wait for at a time.
+
+#define MAXBACKOFF  1024  // TAS: longest pause between tries
+#define TICKETWAIT  16    // TICKET: pauses per CPU ahead in line
+#define NMCSNODE    8     // MCS: nodes per CPU
+
+#if defined(LOCK_TICKET)
+
+static uint
+lockwait(struct spinlock *lk)
+{
+  uint t, n, i, ahead;
+
+  t = __sync_fetch_and_add(&lk->next, 1);
+  n = 0;
+  while((ahead = t - lk->owner) != 0){
+    for(i = 0; i < ahead * TICKETWAIT; i++)
+      pause();
+    n++;
+  }
+  lk->locked = 1;
+  return n;
+}
+
+static void
+lockhandoff(struct spinlock *lk)
+{
+  lk->locked = 0;
+  // Only the holder writes owner, so no atomic add is needed.
+  asm volatile("incl %0" : "+m" (lk->owner) : : "memory");
+}
+
+#elif defined(LOCK_MCS)
+
+struct mcsnode {
+  struct mcsnode *volatile next;  // next CPU in line
+  volatile uint wait;             // cleared to hand over the lock
+  uint used;
+} __attribute__((aligned(CACHELINE)));
+
+static struct mcsnode mcsnode[NCPU][NMCSNODE];
+
+static uint
+lockwait(struct spinlock *lk)
+{
+  struct mcsnode *me, *prev;
+  uint n;
+
+  for(me = mcsnode[mycpu() - cpus]; me->used; me++)
+    if(me == &mcsnode[mycpu() - cpus][NMCSNODE-1])
+      panic("acquire: out of mcs nodes");
+  me->used = 1;
+  me->next = 0;
+  me->wait = 1;
+  n = 0;
+  prev = (struct mcsnode*)xchg((volatile uint*)&lk->tail, (uint)me);
+  if(prev){
+    prev->next = me;
+    while(me->wait){
+      pause();
+      n++;
+    }
+  }
+  lk->node = me;
+  lk->locked = 1;
+  return n;
+}
+
+static void
+lockhandoff(struct spinlock *lk)
+{
+  struct mcsnode *me;
+
+  me = lk->node;
+  lk->locked = 0;
+  if(me->next == 0){
+    // Nobody in line, unless a CPU has swapped itself into
+    // lk->tail but not yet linked itself to us.
+    if(__sync_bool_compare_and_swap(&lk->tail, me, 0)){
+      me->used = 0;
+      return;
+    }
+    while(me->next == 0)
+      pause();
+  }
+  me->next->wait = 0;
+  me->used = 0;
+}
+
+#else  // LOCK_TAS
+
+static uint
+lockwait(struct spinlock *lk)
+{
+  uint n, i, backoff;
+
+  n = 0;
+  backoff = 1;
+  // The xchg is atomic.
+  while(xchg(&lk->locked, 1) != 0){
+    for(i = 0; i < backoff; i++)
+      pause();
+    if(backoff < MAXBACKOFF)
+      backoff *= 2;
+    while(lk->locked)
+      pause();
+    n++;
+  }
+  return n;
+}
+
+static void
+lockhandoff(struct spinlock *lk)
+{
+  // Release the lock, equivalent to lk->locked = 0.
+  // This code can't use a C assignment, since it might
+  // not be atomic. A real OS would use C atomics here.
+  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+}
+
+#endif
 
 void
 initlock(struct spinlock *lk, char *name)
@@ -15,6 +279,21 @@ initlock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->cls = lockclass(name);
+  countlock(lk->cls, 1);
+#if defined(LOCK_TICKET)
+  lk->next = lk->owner = 0;
+#elif defined(LOCK_MCS)
+  lk->tail = lk->node = 0;
+#endif
+}
+
+// Forget lk, which is being freed, in lockstat's count of
+// live locks.
+void
+droplock(struct spinlock *lk)
+{
+  countlock(lk->cls, -1);
 }
 
 // Acquire the lock.
@@ -24,13 +303,13 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint n;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  n = lockwait(lk);
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +319,28 @@ acquire(struct spinlock *lk)
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
   getcallerpcs(&lk, lk->pcs);
+  ls.count[lk->cpu - cpus][lk->cls].nacquire++;
+  if(n > 0)
+    lockcontend(lk, n);
+  lk->tsc = rdtsc();
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  struct lockcount *c;
+  uint t;
+
   if(!holding(lk))
     panic("release");
 
+  t = rdtsc() - lk->tsc;
+  c = &ls.count[lk->cpu - cpus][lk->cls];
+  c->hold += t;
+  if(t > c->maxhold)
+    c->maxhold = t;
+
   lk->pcs[0] = 0;
   lk->cpu = 0;
 
@@ -59,10 +351,7 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  lockhandoff(lk);
 
   popcli();
 }
@@ -120,3 +409,60 @@ popcli(void)
     sti();
 }
 
+
+//PAGEBREAK!
+// Add site (pc, cnt) to the LSSITES most contended sites in st.
+static void
+addsite(struct lockstat *st, uint pc, uint cnt)
+{
+  int i, min;
+
+  min = 0;
+  for(i = 0; i < LSSITES; i++){
+    if(st->sitepc[i] == pc && st->sitecnt[i] > 0){
+      st->sitecnt[i] += cnt;
+      return;
+    }
+    if(st->sitecnt[i] < st->sitecnt[min])
+      min = i;
+  }
+  if(cnt > st->sitecnt[min]){
+    st->sitepc[min] = pc;
+    st->sitecnt[min] = cnt;
+  }
+}
+
+// Copy the statistics of up to n lock classes into st, summed
+// over all CPUs, and return how many were copied.  If reset,
+// start counting afresh.  No lock: counts that change meanwhile
+// may be off by a little.
+int
+getlockstat(struct lockstat *st, int n, int reset)
+{
+  struct lockcount *c;
+  unsigned long long hold;
+  int i, k, cpu;
+
+  for(i = 0; i < ls.ncls && i < n; i++){
+    memset(&st[i], 0, sizeof(st[i]));
+    safestrcpy(st[i].name, ls.name[i], LSNAME);
+    hold = 0;
+    for(cpu = 0; cpu < ncpu; cpu++){
+      st[i].nlock += ls.nlock[cpu][i];
+      c = &ls.count[cpu][i];
+      st[i].nacquire += c->nacquire;
+      st[i].ncontend += c->ncontend;
+      st[i].nspin += c->nspin;
+      hold += c->hold;
+      if(c->maxhold > st[i].maxhold)
+        st[i].maxhold = c->maxhold;
+      for(k = 0; k < LSSITES; k++)
+        if(c->sitecnt[k] > 0)
+          addsite(&st[i], c->sitepc[k], c->sitecnt[k]);
+    }
+    st[i].hold = hold >> 10;
+  }
+  if(reset)
+    memset(ls.count, 0, sizeof(ls.count));
+  return i;
+}
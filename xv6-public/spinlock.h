@@ -1,11 +1,25 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock.  The Makefile's LOCK setting picks
+// how waiting CPUs queue up for it (see spinlock.c).
+struct mcsnode;
+
 struct spinlock {
   uint locked;       // Is the lock held?
+#if defined(LOCK_TICKET)
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket allowed to hold the lock.
+#elif defined(LOCK_MCS)
+  struct mcsnode *tail;  // Last CPU in line, 0 if free.
+  struct mcsnode *node;  // The holder's place in line.
+#endif
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+
+  // For lockstat:
+  int cls;           // Lock class, shared by locks of the same name.
+  uint tsc;          // rdtsc() when acquired.
 };
 
@@ -0,0 +1,291 @@
+// Buffered I/O on file descriptors.
+//
+// Each fd below NFD gets, when first used, a buffer for output
+// and one for input.  How output is buffered is chosen on first
+// use, as in C stdio: fd 2 is unbuffered, written out at the end
+// of every call (so one printf is still one write); devices, the
+// console, are line buffered; files and pipes are fully buffered
+// and written BUFSZ bytes at a time.  fsetbuf changes it.
+//
+// exit, fork and exec (in ulib.c) flush every buffer first, and
+// close flushes and forgets the fd's, through stdiohook.  Reading
+// into an empty input buffer flushes line buffered output first,
+// so that a prompt shows before the program waits.
+//
+// Input is read BUFSZ bytes at a time.  As with C stdio, this
+// reads ahead: bytes the process has not used yet are lost to
+// others sharing the fd, such as a child started later.  Console
+// reads stop at a newline, so sh and its children are not
+// affected.
+//
+// Each buffer has a lock, so that threads can share fds.  An
+// output call that cannot get the lock soon, such as an alarm
+// handler that interrupted a printf, writes directly rather than
+// wait for a lock its own thread may hold.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define NFD    16      // fds with buffers; NOFILE
+#define BUFSZ  512
+#define SPIN   10000   // tries at a busy lock before giving up
+
+struct fbuf {
+  volatile uint lock;
+  int mode;            // BUF_*, or 0 if not chosen yet
+  int nout;            // bytes in out
+  int rpos;            // unread input is in[rpos..rend)
+  int rend;
+  char out[BUFSZ];
+  char in[BUFSZ];
+};
+
+extern void (*stdiohook)(int);
+
+static struct fbuf *fbuf[NFD];
+static volatile uint fbuflock;   // protects allocating fbuf[]
+
+static void stdioflush(int);
+
+static int
+lock(volatile uint *l, int wait)
+{
+  int i;
+
+  for(i = 0; xchg(l, 1) != 0; i++)
+    if(!wait && i == SPIN)
+      return 0;
+  return 1;
+}
+
+static void
+unlock(volatile uint *l)
+{
+  xchg(l, 0);
+}
+
+// Return fd's buffer, locked, or 0 if it has none or it stayed
+// busy and !wait.
+static struct fbuf*
+getbuf(int fd, int wait)
+{
+  struct fbuf *b;
+  struct stat st;
+
+  if(fd < 0 || fd >= NFD)
+    return 0;
+  if((b = fbuf[fd]) == 0){
+    lock(&fbuflock, 1);
+    if((b = fbuf[fd]) == 0 && (b = malloc(sizeof(*b))) != 0){
+      memset(b, 0, sizeof(*b));
+      fbuf[fd] = b;
+      stdiohook = stdioflush;
+    }
+    unlock(&fbuflock);
+    if(b == 0)
+      return 0;
+  }
+  if(!lock(&b->lock, wait))
+    return 0;
+
+  if(b->mode == 0){
+    // fstat fails on pipes.
+    if(fd == 2)
+      b->mode = BUF_NONE;
+    else if(fstat(fd, &st) == 0 && st.type == T_DEV)
+      b->mode = BUF_LINE;
+    else
+      b->mode = BUF_FULL;
+  }
+  return b;
+}
+
+// Write out b's output.  Caller holds b->lock.
+static int
+flush(struct fbuf *b, int fd)
+{
+  int i, n;
+
+  for(i = 0; i < b->nout; i += n)
+    if((n = write(fd, b->out + i, b->nout - i)) <= 0)
+      break;
+  n = i < b->nout ? -1 : 0;
+  b->nout = 0;
+  return n;
+}
+
+// Flush the buffers of every fd, or of fds with line buffered
+// output if lineonly; then, if fd >= 0, forget fd's buffered
+// output and input, as fd is being closed.
+static void
+flushall(int fd, int lineonly)
+{
+  struct fbuf *b;
+  int i;
+
+  for(i = 0; i < NFD; i++){
+    if(fbuf[i] == 0 || (fd >= 0 && i != fd))
+      continue;
+    if(lineonly && fbuf[i]->mode != BUF_LINE)
+      continue;
+    if((b = getbuf(i, 0)) == 0)
+      continue;
+    flush(b, i);
+    if(fd >= 0){
+      b->mode = 0;
+      b->rpos = b->rend = 0;
+    }
+    unlock(&b->lock);
+  }
+}
+
+static void
+stdioflush(int fd)
+{
+  flushall(fd, 0);
+}
+
+//PAGEBREAK!
+// Output.
+
+int
+fwrite(int fd, void *buf, int n)
+{
+  struct fbuf *b;
+  char *p;
+  int r;
+
+  if((b = getbuf(fd, 0)) == 0)
+    return write(fd, buf, n);
+
+  r = n;
+  if(b->mode == BUF_NONE || n >= BUFSZ){
+    if(flush(b, fd) < 0 || write(fd, buf, n) != n)
+      r = -1;
+  } else {
+    if(b->nout + n > BUFSZ && flush(b, fd) < 0)
+      r = -1;
+    memmove(b->out + b->nout, buf, n);
+    b->nout += n;
+    if(b->mode == BUF_LINE){
+      for(p = buf; p < (char*)buf + n; p++)
+        if(*p == '\n')
+          break;
+      if(p < (char*)buf + n && flush(b, fd) < 0)
+        r = -1;
+    }
+  }
+  unlock(&b->lock);
+  return r;
+}
+
+int
+fputc(int fd, int c)
+{
+  char ch;
+
+  ch = c;
+  if(fwrite(fd, &ch, 1) != 1)
+    return -1;
+  return c & 0xff;
+}
+
+int
+fflush(int fd)
+{
+  struct fbuf *b;
+  int r;
+
+  if((b = getbuf(fd, 0)) == 0)
+    return 0;
+  r = flush(b, fd);
+  unlock(&b->lock);
+  return r;
+}
+
+// Set how fd's output is buffered: BUF_NONE, BUF_LINE or
+// BUF_FULL.  Until fd is closed.
+int
+fsetbuf(int fd, int mode)
+{
+  struct fbuf *b;
+
+  if(mode < BUF_NONE || mode > BUF_FULL || (b = getbuf(fd, 1)) == 0)
+    return -1;
+  flush(b, fd);
+  b->mode = mode;
+  unlock(&b->lock);
+  return 0;
+}
+
+//PAGEBREAK!
+// Input.
+
+// Return fd's buffer, locked, with input in it, or 0 at end of
+// file or on error.  *nobuf is set if fd has no buffer.
+static struct fbuf*
+getinput(int fd, int *nobuf)
+{
+  struct fbuf *b;
+  int n;
+
+  *nobuf = 0;
+  if(fd >= 0 && fd < NFD && (fbuf[fd] == 0 || fbuf[fd]->rpos == fbuf[fd]->rend))
+    flushall(-1, 1);
+  if((b = getbuf(fd, 1)) == 0){
+    *nobuf = 1;
+    return 0;
+  }
+  if(b->rpos == b->rend){
+    if((n = read(fd, b->in, BUFSZ)) <= 0){
+      unlock(&b->lock);
+      return 0;
+    }
+    b->rpos = 0;
+    b->rend = n;
+  }
+  return b;
+}
+
+// Return the next byte from fd, or -1 at end of file.
+int
+fgetc(int fd)
+{
+  struct fbuf *b;
+  int nobuf;
+  uchar c;
+
+  if((b = getinput(fd, &nobuf)) == 0){
+    if(nobuf && read(fd, &c, 1) == 1)
+      return c;
+    return -1;
+  }
+  c = b->in[b->rpos++];
+  unlock(&b->lock);
+  return c;
+}
+
+// Read a line from fd into buf, as gets does.
+char*
+fgets(int fd, char *buf, int max)
+{
+  int i, c;
+
+  for(i = 0; i+1 < max; ){
+    if((c = fgetc(fd)) < 0)
+      break;
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = '\0';
+  return buf;
+}
+
+char*
+gets(char *buf, int max)
+{
+  return fgets(0, buf, max);
+}
@@ -0,0 +1,114 @@
+// Measure what buffered stdio saves.
+//
+//   stdiobench [n]
+//
+// Runs "ls" and "cat README" n times each (default 10) with
+// their output going to a file, and prints the system calls
+// and ticks per run (see syscount).  Then prints the same lines
+// n times with printf, once through stdio and once a write per
+// byte, as printf used to.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define OUT    "stdiobench.out"
+#define NLINE  100   // lines per printf run
+
+char *lsargv[] = { "ls", 0 };
+char *catargv[] = { "cat", "README", 0 };
+
+void
+report(char *what, int n, int t0, int c0)
+{
+  int t, c;
+
+  t = uptime() - t0;
+  c = syscount(1) - c0;
+  printf(1, "%s: %d syscalls/run, %d ticks for %d runs\n", what, c/n, t, n);
+}
+
+// Run argv n times with stdout to OUT.
+void
+run(char **argv, int n, char *what)
+{
+  int i, t0, c0;
+
+  t0 = uptime();
+  c0 = syscount(1);
+  for(i = 0; i < n; i++){
+    unlink(OUT);
+    if(fork() == 0){
+      close(1);
+      if(open(OUT, O_CREATE|O_WRONLY) != 1){
+        printf(2, "stdiobench: cannot create %s\n", OUT);
+        exit();
+      }
+      exec(argv[0], argv);
+      printf(2, "stdiobench: exec %s failed\n", argv[0]);
+      exit();
+    }
+    wait();
+  }
+  report(what, n, t0, c0);
+}
+
+void
+lines(int fd, int perbyte)
+{
+  char line[] = "README         2 2 2290\n";
+  int i, j;
+
+  for(i = 0; i < NLINE; i++){
+    if(!perbyte){
+      printf(fd, "%s %d %d %d\n", "README        ", 2, 2, 2290);
+      continue;
+    }
+    for(j = 0; line[j]; j++)
+      write(fd, &line[j], 1);
+  }
+}
+
+// Print NLINE lines to OUT n times, in a child.
+void
+printrun(int n, int perbyte, char *what)
+{
+  int i, fd, t0, c0;
+
+  t0 = uptime();
+  c0 = syscount(1);
+  for(i = 0; i < n; i++){
+    unlink(OUT);
+    if(fork() == 0){
+      if((fd = open(OUT, O_CREATE|O_WRONLY)) < 0)
+        exit();
+      lines(fd, perbyte);
+      close(fd);
+      exit();
+    }
+    wait();
+  }
+  report(what, n, t0, c0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  n = 10;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1){
+    printf(2, "usage: stdiobench [n]\n");
+    exit();
+  }
+
+  run(lsargv, n, "ls");
+  run(catargv, n, "cat README");
+  printrun(n, 0, "printf, stdio");
+  printrun(n, 1, "printf, write per byte");
+  unlink(OUT);
+  exit();
+}
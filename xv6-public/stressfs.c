@@ -6,6 +6,10 @@
 // after about 5 runs of stressfs in QEMU on a 2.1GHz CPU:
 //    for (i = 0; i < 40000; i++)
 //      asm volatile("");
+//
+// Also a file system throughput benchmark: "stressfs n" runs
+// n+1 concurrent writers (default 4+1) and reports how long
+// they took, e.g. to compare logging schemes.
 
 #include "types.h"
 #include "stat.h"
@@ -16,16 +20,24 @@
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, me, nwriters, t0;
   char path[] = "stressfs0";
   char data[512];
 
+  nwriters = 4;
+  if(argc > 1)
+    nwriters = atoi(argv[1]);
+  if(nwriters < 0 || nwriters > 9)
+    nwriters = 4;
+
   printf(1, "stressfs starting\n");
   memset(data, 'a', sizeof(data));
+  t0 = uptime();
 
-  for(i = 0; i < 4; i++)
+  for(i = 0; i < nwriters; i++)
     if(fork() > 0)
       break;
+  me = i;
 
   printf(1, "write %d\n", i);
 
@@ -45,5 +57,8 @@ main(int argc, char *argv[])
 
   wait();
 
+  if(me == 0)
+    printf(1, "stressfs: %d writers, %d bytes each, %d ticks\n",
+           nwriters+1, 20*sizeof(data), uptime()-t0);
   exit();
 }
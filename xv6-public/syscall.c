@@ -3,6 +3,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
@@ -53,22 +54,56 @@ argint(int n, int *ip)
 }
 
 // Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+// to a block of memory of size bytes that the kernel will
+// write if write is set.  Check that the pointer lies within
+// the process address space, and fault the block in, breaking
+// copy-on-write if write is set, so that the kernel can use it
+// while holding spinlocks.  The block stays pinned until the
+// system call returns: other threads cannot unmap it, and
+// fork copies its pages rather than making them copy-on-write.
+static int
+argbuf(int n, char **pp, int size, int write)
 {
   int i;
   struct proc *curproc = myproc();
 
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0)
+    return -1;
+  vmlock(curproc);
+  if(((uint)i >= curproc->sz || (uint)i+size > curproc->sz) &&
+     !vmarange(curproc->group, i, size)){
+    vmunlock(curproc);
+    return -1;
+  }
+  if(vmprefault(curproc->group, i, size, write) < 0){
+    vmunlock(curproc);
     return -1;
+  }
+  if(size > 0){
+    curproc->pinstart = i;
+    curproc->pinend = i + size;
+  }
+  vmunlock(curproc);
   *pp = (char*)i;
   return 0;
 }
 
+// A block the kernel reads.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 0);
+}
+
+// A block the kernel writes.
+int
+argwptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -107,6 +142,20 @@ extern int sys_uptime(void);
 extern int sys_date(void);
 // 表示sys_alarm在其他源文件实现
 extern int sys_alarm(void);
+extern int sys_sync(void);
+extern int sys_fsync(void);
+extern int sys_setpriority(void);
+extern int sys_getpriority(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futex(void);
+extern int sys_lockstat(void);
+extern int sys_profile(void);
+extern int sys_profread(void);
+extern int sys_syscount(void);
+extern int sys_fragstat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -132,7 +181,21 @@ static int (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 // 在内核系统调用表中,增加系统调用date的实际实现函数
 [SYS_date]    sys_date,
-[SYS_alarm]   sys_alarm
+[SYS_alarm]   sys_alarm,
+[SYS_sync]    sys_sync,
+[SYS_fsync]   sys_fsync,
+[SYS_setpriority] sys_setpriority,
+[SYS_getpriority] sys_getpriority,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex]   sys_futex,
+[SYS_lockstat] sys_lockstat,
+[SYS_profile] sys_profile,
+[SYS_profread] sys_profread,
+[SYS_syscount] sys_syscount,
+[SYS_fragstat] sys_fragstat,
 };
 
 /* static char* syscalls_name[] = { */
@@ -167,8 +230,10 @@ syscall(void)
   struct proc *curproc = myproc();
 
   num = curproc->tf->eax;
+  curproc->nsyscall++;
   if(num > 0 && num < (int)NELEM(syscalls) && syscalls[num]) {
     curproc->tf->eax = syscalls[num]();
+    curproc->pinend = 0;  // unpin argptr's block
     /* cprintf("%s -> %d\n", syscalls_name[num], curproc->tf->eax); */
   } else {
     cprintf("%d %s: unknown sys call %d\n",
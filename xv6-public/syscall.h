@@ -24,3 +24,17 @@
 #define SYS_date   22
 // alarm系统调用号,对应系统调用表中的函数
 #define SYS_alarm   23
+#define SYS_sync    24
+#define SYS_fsync   25
+#define SYS_setpriority 26
+#define SYS_getpriority 27
+#define SYS_mmap    28
+#define SYS_munmap  29
+#define SYS_clone   30
+#define SYS_join    31
+#define SYS_futex   32
+#define SYS_lockstat 33
+#define SYS_profile 34
+#define SYS_profread 35
+#define SYS_syscount 36
+#define SYS_fragstat 37
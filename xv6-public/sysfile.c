@@ -9,30 +9,50 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "fragstat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return the corresponding struct file.  The fd table is
+// shared by a thread group (it is the leader's, p->group), so
+// while there are other threads, one of which may close fd,
+// argfd takes a reference to the file.  Returns -1 on error,
+// else whether the caller must drop a reference with fdput.
 static int
-argfd(int n, int *pfd, struct file **pf)
+argfd(int n, struct file **pf)
 {
-  int fd;
+  int fd, ref;
   struct file *f;
+  struct proc *curproc = myproc(), *g = curproc->group;
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
-  if(pfd)
-    *pfd = fd;
-  if(pf)
-    *pf = f;
-  return 0;
+  // Only the group's threads add threads, so if there are
+  // none besides us, there will be none until we return.
+  ref = curproc != g || g->nthread > 0;
+  acquire(&g->glock);
+  if((f = g->ofile[fd]) != 0 && ref)
+    filedup(f);
+  release(&g->glock);
+  if(f == 0)
+    return -1;
+  *pf = f;
+  return ref;
+}
+
+static void
+fdput(struct file *f, int ref)
+{
+  if(ref)
+    fileclose(f);
 }
 
 // Allocate a file descriptor for the given file.
@@ -41,14 +61,17 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *curproc = myproc();
+  struct proc *g = myproc()->group;
 
+  acquire(&g->glock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
+    if(g->ofile[fd] == 0){
+      g->ofile[fd] = f;
+      release(&g->glock);
       return fd;
     }
   }
+  release(&g->glock);
   return -1;
 }
 
@@ -56,13 +79,14 @@ int
 sys_dup(void)
 {
   struct file *f;
-  int fd;
+  int fd, ref;
 
-  if(argfd(0, 0, &f) < 0)
-    return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((ref = argfd(0, &f)) < 0)
     return -1;
   filedup(f);
+  if((fd=fdalloc(f)) < 0)
+    fileclose(f);
+  fdput(f, ref);
   return fd;
 }
 
@@ -70,24 +94,28 @@ int
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r, ref;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argwptr(1, &p, n) < 0 || (ref = argfd(0, &f)) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fdput(f, ref);
+  return r;
 }
 
 int
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r, ref;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || (ref = argfd(0, &f)) < 0)
     return -1;
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fdput(f, ref);
+  return r;
 }
 
 int
@@ -95,10 +123,16 @@ sys_close(void)
 {
   int fd;
   struct file *f;
+  struct proc *g = myproc()->group;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argint(0, &fd) < 0 || fd < 0 || fd >= NOFILE)
+    return -1;
+  acquire(&g->glock);
+  if((f = g->ofile[fd]) != 0)
+    g->ofile[fd] = 0;
+  release(&g->glock);
+  if(f == 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -108,10 +142,13 @@ sys_fstat(void)
 {
   struct file *f;
   struct stat *st;
+  int r, ref;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argwptr(1, (void*)&st, sizeof(*st)) < 0 || (ref = argfd(0, &f)) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fdput(f, ref);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -218,6 +255,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcremove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -258,7 +296,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0)
     panic("create: ialloc");
 
   ilock(ip);
@@ -373,8 +411,8 @@ int
 sys_chdir(void)
 {
   char *path;
-  struct inode *ip;
-  struct proc *curproc = myproc();
+  struct inode *ip, *old;
+  struct proc *g = myproc()->group;
   
   begin_op();
   if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
@@ -388,9 +426,12 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(curproc->cwd);
+  acquire(&g->glock);
+  old = g->cwd;
+  g->cwd = ip;
+  release(&g->glock);
+  iput(old);
   end_op();
-  curproc->cwd = ip;
   return 0;
 }
 
@@ -425,17 +466,26 @@ sys_pipe(void)
 {
   int *fd;
   struct file *rf, *wf;
+  struct proc *g;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argwptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 >= 0){
+      g = myproc()->group;
+      acquire(&g->glock);
+      if(g->ofile[fd0] == rf)
+        g->ofile[fd0] = 0;
+      else
+        rf = 0;  // a sibling thread closed fd0 already
+      release(&g->glock);
+    }
+    if(rf)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
@@ -443,3 +493,123 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+// Flush the log: every FS system call that has returned
+// is on disk when sync returns.
+int
+sys_sync(void)
+{
+  log_sync();
+  return 0;
+}
+
+// The log is shared by all files, so making one file
+// durable means flushing all of it.
+int
+sys_fsync(void)
+{
+  struct file *f;
+  int ref;
+
+  if((ref = argfd(0, &f)) < 0)
+    return -1;
+  if(f->type == FD_INODE)
+    log_sync();
+  fdput(f, ref);
+  return 0;
+}
+
+// Copy file system fragmentation statistics to user memory.
+int
+sys_fragstat(void)
+{
+  struct fragstat st;
+  char *p;
+
+  if(argwptr(0, &p, sizeof(st)) < 0)
+    return -1;
+  getfragstat(ROOTDEV, &st);
+  memmove(p, &st, sizeof(st));
+  return 0;
+}
+
+// Add a region to the address space of the current
+// process, which its threads share.
+static int
+mmapproc(uint len, int flags, struct inode *ip, uint off, uint filesz)
+{
+  struct proc *curproc = myproc();
+  int r;
+
+  vmlock(curproc);
+  r = vmamap(curproc->group, len, flags, ip, off, filesz);
+  vmunlock(curproc);
+  return r;
+}
+
+// Map len bytes of fd starting at page-aligned off, or
+// anonymous zero memory with MAP_ANON (fd is ignored).
+// addr is only a hint and is ignored; the kernel picks
+// the address.  Pages are read on first touch.
+int
+sys_mmap(void)
+{
+  int addr, len, prot, flags, off, vflags, r, ref;
+  uint filesz;
+  struct file *f;
+  struct inode *ip;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  vflags = 0;
+  if(prot & PROT_WRITE)
+    vflags |= VMA_WRITE;
+  if(flags & MAP_SHARED)
+    vflags |= VMA_SHARED;
+  if(flags & MAP_ANON)
+    return mmapproc(len, vflags, 0, 0, 0);
+
+  if((ref = argfd(4, &f)) < 0)
+    return -1;
+  r = -1;
+  ip = f->ip;
+  if(f->type != FD_INODE || !f->readable ||
+     ((vflags & VMA_SHARED) && (vflags & VMA_WRITE) && !f->writable))
+    goto out;
+  ilock(ip);
+  if(ip->type != T_FILE){
+    iunlock(ip);
+    goto out;
+  }
+  filesz = ip->size > off ? ip->size - off : 0;
+  iunlock(ip);
+  if(filesz > len)
+    filesz = len;
+  r = mmapproc(len, vflags, ip, off, filesz);
+out:
+  fdput(f, ref);
+  return r;
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len, r;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || len <= 0 || (uint)addr + len < (uint)addr)
+    return -1;
+  vmlock(myproc());
+  if(vmpinned(myproc(), addr, PGROUNDUP((uint)addr + len)))
+    r = -1;  // another thread's system call is using it
+  else
+    r = vmaunmap(myproc()->group, addr, (uint)addr + len);
+  vmunlock(myproc());
+  return r;
+}
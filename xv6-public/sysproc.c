@@ -5,7 +5,11 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
+#include "futex.h"
+#include "lockstat.h"
+#include "profile.h"
 
 int
 sys_fork(void)
@@ -60,16 +64,27 @@ sys_sbrk(void)
   /*   return -1; */
 
   // new
+  // 线程共享地址空间,sz要在整个线程组中更新;也不能长进mmap区域
+  // Shrinking frees the pages at once (see deallocuvm).
   struct proc *curproc = myproc();
+  vmlock(curproc);
   addr = curproc->sz;
 
-  if((uint)addr+n > KERNBASE)
+  if(n >= 0 && ((uint)addr+n > vmalimit(curproc->group) || (uint)addr+n < (uint)addr)){
+    vmunlock(curproc);
     return -1;
+  }
+  // Nor shrink under another thread's system call buffer.
+  if(n < 0 && ((uint)addr+n > (uint)addr ||
+               vmpinned(curproc, PGROUNDUP((uint)addr+n), PGROUNDUP((uint)addr)))){
+    vmunlock(curproc);
+    return -1;
+  }
 
   if(n < 0)
-    return addr;
-
-  curproc->sz += n;
+    deallocuvm(curproc->pgdir, addr, addr + n);
+  setsz(curproc, addr + n);
+  vmunlock(curproc);
 
   return addr;
 }
@@ -113,7 +128,7 @@ int
 sys_date(void) {
   struct rtcdate* r;
   // 从用户空间栈顶获取参数
-  if(argptr(0, (void*)&r, sizeof(*r)) < 0)
+  if(argwptr(0, (void*)&r, sizeof(*r)) < 0)
     return -1;
 
   cmostime(r);
@@ -134,6 +149,117 @@ sys_alarm(void)
     return -1;
   myproc()->alarmticks = ticks;
   myproc()->alarmhandler = handler;
+  myproc()->pastticks = 0;
   //cprintf("sys_alarm called\n");
   return 0;
 }
+
+int
+sys_setpriority(void)
+{
+  int pid, nice;
+
+  if(argint(0, &pid) < 0 || argint(1, &nice) < 0)
+    return -1;
+  return setpriority(pid, nice);
+}
+
+int
+sys_getpriority(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return getpriority(pid);
+}
+
+int
+sys_clone(void)
+{
+  char *fcn, *arg1, *arg2, *stack;
+
+  if(argint(0, (int*)&fcn) < 0 || argint(1, (int*)&arg1) < 0 ||
+     argint(2, (int*)&arg2) < 0 || argptr(3, &stack, PGSIZE) < 0)
+    return -1;
+  return clone((void(*)(void*, void*))fcn, arg1, arg2, stack);
+}
+
+int
+sys_join(void)
+{
+  char *stack;
+
+  if(argwptr(0, &stack, sizeof(void*)) < 0)
+    return -1;
+  return join((void**)stack);
+}
+
+int
+sys_futex(void)
+{
+  char *addr;
+  int op, val;
+
+  if(argptr(0, &addr, sizeof(int)) < 0 || argint(1, &op) < 0 ||
+     argint(2, &val) < 0)
+    return -1;
+  if(op == FUTEX_WAIT)
+    return futexwait((int*)addr, val);
+  if(op == FUTEX_WAKE)
+    return futexwake((int*)addr, val);
+  return -1;
+}
+
+// Copy up to n lock statistics records to user memory and
+// return how many there were; reset the counts if asked.
+int
+sys_lockstat(void)
+{
+  char *st;
+  int n, reset;
+
+  if(argint(1, &n) < 0 || argint(2, &reset) < 0 || n < 0)
+    return -1;
+  if(n > NLOCKCLASS)
+    n = NLOCKCLASS;
+  if(argwptr(0, &st, n * sizeof(struct lockstat)) < 0)
+    return -1;
+  return getlockstat((struct lockstat*)st, n, reset);
+}
+
+int
+sys_profile(void)
+{
+  int rate;
+
+  if(argint(0, &rate) < 0)
+    return -1;
+  return profile(rate);
+}
+
+int
+sys_profread(void)
+{
+  char *dst;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 || n > PGSIZE ||
+     argwptr(0, &dst, n * sizeof(struct profsample)) < 0)
+    return -1;
+  return profread((struct profsample*)dst, n);
+}
+
+// Number of system calls the caller has made, or if children
+// is set, that its reaped children and threads made.
+int
+sys_syscount(void)
+{
+  int children;
+
+  if(argint(0, &children) < 0)
+    return -1;
+  if(children)
+    return myproc()->cnsyscall;
+  return myproc()->nsyscall;
+}
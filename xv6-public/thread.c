@@ -0,0 +1,72 @@
+// Kernel threads for user programs: kthread_create and
+// kthread_join wrap clone and join, and struct mutex is a
+// lock built on futex.
+
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+#include "futex.h"
+
+#define PGSIZE 4096
+
+// Start a thread running fcn(arg1, arg2) on a fresh one-page
+// stack.  The malloc'd block the stack came from is saved
+// just below it, for kthread_join to free.
+int
+kthread_create(void (*fcn)(void*, void*), void *arg1, void *arg2)
+{
+  char *mem, *stack;
+  int pid;
+
+  if((mem = malloc(2*PGSIZE)) == 0)
+    return -1;
+  stack = (char*)(((uint)mem + sizeof(void*) + PGSIZE-1) & ~(PGSIZE-1));
+  ((char**)stack)[-1] = mem;
+  if((pid = clone(fcn, arg1, arg2, stack)) < 0)
+    free(mem);
+  return pid;
+}
+
+// Wait for a thread to exit and free its stack.
+int
+kthread_join(void)
+{
+  void *stack;
+  int pid;
+
+  if((pid = join(&stack)) >= 0)
+    free(((char**)stack)[-1]);
+  return pid;
+}
+
+// A mutex that sleeps in the kernel only when contended.
+// m->v is 0 if free, 1 if held, 2 if held and others may wait.
+void
+mutex_init(struct mutex *m)
+{
+  m->v = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->v, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = xchg((volatile uint*)&m->v, 2);
+  while(c != 0){
+    futex((int*)&m->v, FUTEX_WAIT, 2);
+    c = xchg((volatile uint*)&m->v, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->v, 1) != 1){
+    m->v = 0;
+    futex((int*)&m->v, FUTEX_WAKE, 1);
+  }
+}
@@ -0,0 +1,75 @@
+// Measure parallel speedup of kernel threads.
+// For 1, 2, ... nthreads threads (default 4), splits a fixed
+// amount of busy work among the threads and times it; each
+// thread also bumps a shared counter under a mutex, which
+// checks that the mutex and futex work.  Run it with CPUS
+// set to at least nthreads.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define WORK   (1<<26)  // loop iterations in total
+#define NLOCK  10000    // mutex-protected increments per thread
+#define MAXT   16
+
+struct mutex m;
+int counter;
+volatile uint sink[MAXT*16];  // one cache line per thread
+
+void
+worker(void *arg1, void *arg2)
+{
+  int id, n, i;
+  uint x;
+
+  id = (int)arg1;
+  n = (int)arg2;
+  x = id;
+  for(i = 0; i < n; i++)
+    x = x * 1103515245 + 12345;
+  sink[id*16] = x;
+  for(i = 0; i < NLOCK; i++){
+    mutex_lock(&m);
+    counter++;
+    mutex_unlock(&m);
+  }
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nthreads, n, i, t0, t1, t1thread;
+
+  nthreads = 4;
+  if(argc > 1)
+    nthreads = atoi(argv[1]);
+  if(nthreads < 1 || nthreads > MAXT){
+    printf(2, "usage: threadbench [nthreads (1-%d)]\n", MAXT);
+    exit();
+  }
+
+  t1thread = 0;
+  for(n = 1; n <= nthreads; n++){
+    mutex_init(&m);
+    counter = 0;
+    t0 = uptime();
+    for(i = 0; i < n; i++)
+      if(kthread_create(worker, (void*)i, (void*)(WORK/n)) < 0){
+        printf(2, "threadbench: kthread_create failed\n");
+        exit();
+      }
+    for(i = 0; i < n; i++)
+      kthread_join();
+    t1 = uptime();
+    if(t1 == t0)
+      t1++;
+    if(n == 1)
+      t1thread = t1 - t0;
+    printf(1, "threadbench: %d threads, %d ticks, speedup %d.%d, counter %s\n",
+           n, t1-t0, t1thread/(t1-t0), 10*t1thread/(t1-t0)%10,
+           counter == n*NLOCK ? "ok" : "WRONG");
+  }
+  exit();
+}
@@ -3,14 +3,15 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
 extern uint vectors[];  // in vectors.S: array of 256 entry pointers
+extern char ucopyfault[];  // in ucopy.S
 struct spinlock tickslock;
 uint ticks;
 int mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm);
@@ -34,30 +35,56 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
-void handle_page_fault() {
+// A fault the kernel cannot fix kills a user process.  In the
+// kernel, only ucopy expects one: it returns -1 instead.
+static void
+badfault(struct trapframe *tf)
+{
+  if((tf->cs & 3) != DPL_USER && tf->eip >= (uint)ucopy && tf->eip < (uint)ucopyfault){
+    tf->eip = (uint)ucopyfault;
+    return;
+  }
+  if(!(tf->eflags & FL_IF))
+    panic("page fault with lock held");
+  exit();
+}
+
+void handle_page_fault(struct trapframe *tf) {
   struct proc *curproc = myproc();
   uint va = PGROUNDDOWN(rcr2());
-  if(va > curproc->sz) {
-    exit();
+  if(curproc == 0)
+    panic("page fault with no process");
+  // A fault with interrupts off came from the kernel holding
+  // a spin lock, so it can neither sleep nor wait for other
+  // CPUs (see tlbflush).  Otherwise, as in a system call, let
+  // interrupts back in.
+  if(!(tf->eflags & FL_IF)){
+    badfault(tf);
     return;
   }
-  char *mem = kalloc();
-  if(mem == 0) {
-    exit();
+  sti();
+  // The page is there, so this is a protection fault:
+  // fine only if it is a write to a copy-on-write page.
+  if(tf->err & FEC_PR) {
+    if(!(tf->err & FEC_WR) || cowcopy(curproc->pgdir, va) < 0)
+      badfault(tf);
     return;
   }
-
-  memset(mem, 0, PGSIZE);
-  mappages(curproc->pgdir, (char*)va, PGSIZE, V2P(mem), PTE_W|PTE_U);
-  switchuvm(curproc);
-  return;
+  vmlock(curproc);
+  if(vmfault(curproc->group, va, tf->err & FEC_WR) < 0){
+    vmunlock(curproc);
+    badfault(tf);
+    return;
+  }
+  vmunlock(curproc);
 }
 
 void handle_alarm(struct trapframe *tf) {
   if(myproc() != 0 && (tf->cs & 3) == 3) {
     myproc()->pastticks++;
     /* cprintf("pastticks++\n"); */
-    if(myproc()->pastticks == myproc()->alarmticks
+    if(myproc()->alarmticks > 0
+       && myproc()->pastticks >= myproc()->alarmticks
        && tf->eip != (uint)myproc()->alarmhandler) {
       myproc()->pastticks = 0;
       /* cprintf("pastticks = 0\n"); */
@@ -72,6 +99,8 @@ void handle_alarm(struct trapframe *tf) {
 void
 trap(struct trapframe *tf)
 {
+  int tick;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -82,15 +111,19 @@ trap(struct trapframe *tf)
     return;
   }
 
+  tick = 0;
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
+    // With the profiler on, not every timer interrupt is a tick.
+    if((tick = proftick(tf)) != 0){
+      if(cpuid() == 0){
+        acquire(&tickslock);
+        ticks++;
+        wakeup(&ticks);
+        release(&tickslock);
+      }
+      handle_alarm(tf);
     }
-    handle_alarm(tf);
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -115,7 +148,12 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
   case T_PGFLT:
-    handle_page_fault();
+    handle_page_fault(tf);
+    break;
+  case T_TLBFLUSH:
+    lcr3(rcr3());
+    mycpu()->tlbgen++;
+    lapiceoi();
     break;
 
   //PAGEBREAK: 13
@@ -140,10 +178,10 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU on clock tick
+  // if it has used up its time slice or is outranked.
   // If interrupts were on while locks held, would need to check nlock.
-  if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+  if(myproc() && myproc()->state == RUNNING && tick && schedtick())
     yield();
 
   // Check if the process has been killed since we yielded
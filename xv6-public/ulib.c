@@ -49,24 +49,6 @@ strchr(const char *s, char c)
   return 0;
 }
 
-char*
-gets(char *buf, int max)
-{
-  int i, cc;
-  char c;
-
-  for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
-    buf[i++] = c;
-    if(c == '\n' || c == '\r')
-      break;
-  }
-  buf[i] = '\0';
-  return buf;
-}
-
 int
 stat(char *n, struct stat *st)
 {
@@ -103,3 +85,54 @@ memmove(void *vdst, void *vsrc, int n)
     *dst++ = *src++;
   return vdst;
 }
+
+// Lower (incr > 0) or raise our base priority level.
+// Returns the new level, or -1 if it is out of range.
+int
+nice(int incr)
+{
+  int pid, prio;
+
+  pid = getpid();
+  prio = getpriority(pid) + incr;
+  if(setpriority(pid, prio) < 0)
+    return -1;
+  return prio;
+}
+
+// Set by stdio.c once it buffers anything, so that programs
+// that do not use it (forktest) do not link it.  Flushes every
+// buffer if fd < 0, else flushes and forgets fd's.
+void (*stdiohook)(int);
+
+int
+fork(void)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  return _fork();
+}
+
+int
+exit(void)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  _exit();
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  return _exec(path, argv);
+}
+
+int
+close(int fd)
+{
+  if(stdiohook)
+    stdiohook(fd);
+  return _close(fd);
+}
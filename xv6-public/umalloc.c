@@ -2,89 +2,319 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "x86.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small requests (up to MAXSMALL bytes) are rounded up to one of
+// NCLASS size classes and served from a per-class free list, so
+// malloc and free are O(1).  Lists are refilled a slab at a time.
+// There are NARENA sets of lists, each with its own lock; a
+// thread uses the set chosen by its stack address, so threads on
+// different stacks rarely contend.  A freed block goes back to
+// the set it came from.
+//
+// Larger requests and slabs come from a segregated-fit heap:
+// free blocks sit on doubly-linked lists binned by powers of two,
+// and carry their size at both ends (boundary tags) so that free
+// coalesces with both neighbours at once.  The heap grows with
+// sbrk, at least HEAPGROW bytes at a time; each piece ends with a
+// zero-size in-use header so that coalescing never runs off it.
+//
+// Every block starts with an 8-byte header, so pointers are
+// 8-byte aligned as before.
 
-typedef long Align;
+#define NCLASS    14
+#define MAXSMALL  1024
+#define SLABSIZE  16384
+#define NARENA    4
+#define NBIN      20
+#define HEAPGROW  65536
+#define MAXALLOC  0x40000000  // largest request; keeps sizes and sbrk's int from overflowing
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+#define INUSE     0x1       // in head: this block is allocated
+#define PINUSE    0x2       // in head: the previous block is allocated
+#define SIZE(b)   ((b)->head & ~7)
+#define LARGE     0xffffffff  // cls of a heap block
+
+typedef struct block Block;
+struct block {
+  uint head;          // size in bytes including header, | INUSE | PINUSE
+  uint cls;           // arena<<8 | class for small blocks, else LARGE
+  Block *next;        // free blocks only: list links
+  Block *prev;
 };
 
-typedef union header Header;
+#define HDR       8     // bytes before the payload
+#define MINBLOCK  24    // header, links and footer
 
-static Header base;
-static Header *freep;
+// Steps of 8 up to 32, then two classes per power of two.
+static uint classsize[NCLASS] = {
+  8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
 
-void
-free(void *ap)
+struct arena {
+  volatile uint lock;
+  Block *free[NCLASS];
+};
+
+static struct arena arena[NARENA];
+
+static struct {
+  volatile uint lock;
+  Block *bin[NBIN];
+  Block *end;         // zero-size header closing the last piece
+} heap;
+
+static void
+lock(volatile uint *l)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  while(xchg(l, 1) != 0)
+    ;
 }
 
-static Header*
-morecore(uint nu)
+static void
+unlock(volatile uint *l)
+{
+  xchg(l, 0);
+}
+
+//PAGEBREAK!
+// The heap.  Caller holds heap.lock.
+
+static Block*
+next(Block *b)
+{
+  return (Block*)((char*)b + SIZE(b));
+}
+
+static int
+binof(uint size)
+{
+  int i;
+
+  for(i = 0; size > 32 && i < NBIN-1; i++)
+    size >>= 1;
+  return i;
+}
+
+static void
+binput(Block *b)
+{
+  Block **l;
+
+  l = &heap.bin[binof(SIZE(b))];
+  b->prev = 0;
+  b->next = *l;
+  if(*l)
+    (*l)->prev = b;
+  *l = b;
+}
+
+static void
+binremove(Block *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    heap.bin[binof(SIZE(b))] = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+// Make b, of size bytes, a free block: merge it with free
+// neighbours, write its tags and put it on its bin.
+static void
+heapfree(Block *b, uint size)
+{
+  Block *n, *p;
+
+  n = (Block*)((char*)b + size);
+  if(!(n->head & INUSE)){
+    binremove(n);
+    size += SIZE(n);
+  }
+  if(!(b->head & PINUSE)){
+    p = (Block*)((char*)b - ((uint*)b)[-1]);
+    binremove(p);
+    size += SIZE(p);
+    b = p;
+  }
+  b->head = size | PINUSE;  // the block before a free block is in use
+  b->cls = LARGE;
+  *(uint*)((char*)b + size - 4) = size;
+  n = next(b);
+  n->head &= ~PINUSE;
+  binput(b);
+}
+
+// Add a free block of at least size bytes to the heap.
+static int
+heapgrow(uint size)
 {
   char *p;
-  Header *hp;
+  uint n;
+  Block *b;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
-    return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  if(size > MAXALLOC + HDR)
+    return -1;
+  size = (size + 7) & ~7;
+  if(size < HEAPGROW)
+    size = HEAPGROW;
+  n = size + 2*HDR;  // room for the end header and alignment
+  if((p = sbrk(n)) == (char*)-1)
+    return -1;
+  if(heap.end && p == (char*)heap.end + HDR){
+    // Right after the last piece: its end header becomes
+    // the new block's header.
+    b = heap.end;
+  } else {
+    b = (Block*)(((uint)p + 7) & ~7);
+    b->head = PINUSE;   // nothing before it to merge with
+  }
+  size = (p + n - (char*)b - HDR) & ~7;
+  heap.end = (Block*)((char*)b + size);
+  heap.end->head = INUSE;
+  heap.end->cls = LARGE;
+  b->head = (b->head & PINUSE) | size | INUSE;
+  heapfree(b, size);
+  return 0;
+}
+
+// Allocate a heap block of at least size bytes, header included.
+static Block*
+heapalloc(uint size)
+{
+  Block *b, *r;
+  int i;
+
+  size = (size + 7) & ~7;
+  if(size < MINBLOCK)
+    size = MINBLOCK;
+  for(;;){
+    // First fit in size's own bin; any block of a higher bin fits.
+    for(b = heap.bin[binof(size)]; b; b = b->next)
+      if(SIZE(b) >= size)
+        goto found;
+    for(i = binof(size) + 1; i < NBIN; i++)
+      if((b = heap.bin[i]) != 0)
+        goto found;
+    if(heapgrow(size) < 0)
+      return 0;
+  }
+
+found:
+  binremove(b);
+  if(SIZE(b) - size >= MINBLOCK){
+    r = (Block*)((char*)b + size);
+    r->head = SIZE(b) - size;
+    b->head = size | (b->head & PINUSE) | INUSE;
+    r->head |= PINUSE | INUSE;
+    heapfree(r, SIZE(r));
+  } else {
+    b->head |= INUSE;
+    next(b)->head |= PINUSE;
+  }
+  b->cls = LARGE;
+  return b;
+}
+
+//PAGEBREAK!
+// Size classes.
+
+static int
+classof(uint n)
+{
+  int k;
+
+  if(n <= 32)
+    return n ? (n - 1) / 8 : 0;
+  k = 31 - __builtin_clz(n - 1);  // 2^k < n <= 2^(k+1)
+  return 4 + 2*(k - 5) + (n - 1 >= 3 << (k - 1));
+}
+
+static struct arena*
+myarena(void)
+{
+  uint sp;
+
+  asm volatile("movl %%esp, %0" : "=r" (sp));
+  return &arena[(sp >> 13) % NARENA];
+}
+
+// Carve a slab into blocks of class c for arena a.
+// Caller holds a->lock.
+static int
+refill(struct arena *a, int c)
+{
+  Block *s, *b;
+  char *p, *end;
+  uint bsize;
+
+  lock(&heap.lock);
+  s = heapalloc(SLABSIZE);
+  unlock(&heap.lock);
+  if(s == 0)
+    return -1;
+  bsize = HDR + classsize[c];
+  p = (char*)s + HDR;
+  end = (char*)s + SIZE(s);
+  for(; p + bsize <= end; p += bsize){
+    b = (Block*)p;
+    b->cls = (a - arena) << 8 | c;
+    b->next = a->free[c];
+    a->free[c] = b;
+  }
+  return 0;
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct arena *a;
+  Block *b;
+  int c;
+
+  if(nbytes > MAXALLOC)
+    return 0;
+  if(nbytes > MAXSMALL){
+    lock(&heap.lock);
+    b = heapalloc(HDR + nbytes);
+    unlock(&heap.lock);
+    return b ? (char*)b + HDR : 0;
+  }
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  c = classof(nbytes);
+  a = myarena();
+  lock(&a->lock);
+  if(a->free[c] == 0 && refill(a, c) < 0){
+    unlock(&a->lock);
+    return 0;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+  b = a->free[c];
+  a->free[c] = b->next;
+  unlock(&a->lock);
+  return (char*)b + HDR;
+}
+
+void
+free(void *ap)
+{
+  struct arena *a;
+  Block *b;
+
+  if(ap == 0)
+    return;
+  b = (Block*)((char*)ap - HDR);
+  if(b->cls == LARGE){
+    lock(&heap.lock);
+    heapfree(b, SIZE(b));
+    unlock(&heap.lock);
+    return;
   }
+  a = &arena[b->cls >> 8];
+  lock(&a->lock);
+  b->next = a->free[b->cls & 0xff];
+  a->free[b->cls & 0xff] = b;
+  unlock(&a->lock);
 }
@@ -2,6 +2,14 @@
 
 struct stat;
 struct rtcdate;
+struct lockstat;
+struct profsample;
+struct fragstat;
+
+// A mutex for threads made by kthread_create (see thread.c).
+struct mutex {
+  volatile int v;
+};
 
 // system calls
 int fork(void);
@@ -29,6 +37,26 @@ int uptime(void);
 int date(struct rtcdate*);
 // 用户空间, alarm函数的声明
 int alarm(int ticks, void (*handler)());
+int sync(void);
+int fsync(int);
+int setpriority(int, int);
+int getpriority(int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int clone(void(*)(void*, void*), void*, void*, void*);
+int join(void**);
+int futex(int*, int, int);
+int lockstat(struct lockstat*, int, int);
+int profile(int);
+int profread(struct profsample*, int);
+int syscount(int);
+int fragstat(struct fragstat*);
+
+// usys.S: the system calls ulib.c wraps, to flush stdio first
+int _fork(void);
+int _exit(void) __attribute__((noreturn));
+int _close(int);
+int _exec(char*, char**);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -36,10 +64,29 @@ char* strcpy(char*, char*);
 void *memmove(void*, void*, int);
 char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
-void printf(int, char*, ...);
-char* gets(char*, int max);
 uint strlen(char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+int nice(int);
+
+// printf.c, stdio.c
+#define BUF_NONE 1   // write out at the end of every call
+#define BUF_LINE 2   // ... at each newline
+#define BUF_FULL 3   // ... when the buffer fills
+void printf(int, char*, ...);
+int fwrite(int, void*, int);
+int fputc(int, int);
+int fflush(int);
+int fsetbuf(int, int);
+int fgetc(int);
+char* fgets(int, char*, int max);
+char* gets(char*, int max);
+
+// thread.c
+int kthread_create(void(*)(void*, void*), void*, void*);
+int kthread_join(void);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
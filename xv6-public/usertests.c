@@ -4,6 +4,8 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "futex.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
@@ -135,6 +137,26 @@ opentest(void)
   printf(stdout, "open test ok\n");
 }
 
+// can a running program's file be written?
+void
+textbusytest(void)
+{
+  int fd;
+
+  printf(stdout, "text busy test\n");
+  fd = open("usertests", O_RDWR);
+  if(fd < 0){
+    printf(stdout, "open usertests failed\n");
+    exit();
+  }
+  if(write(fd, "x", 1) >= 0){
+    printf(stdout, "wrote running usertests!\n");
+    exit();
+  }
+  close(fd);
+  printf(stdout, "text busy test ok\n");
+}
+
 void
 writetest(void)
 {
@@ -1347,7 +1369,8 @@ iref(void)
 
   printf(1, "empty file name\n");
 
-  // the 50 is NINODE
+  // Inodes come from a slab cache now, so there is no table
+  // to exhaust; a leaked reference would still pile up here.
   for(i = 0; i < 50 + 1; i++){
     if(mkdir("irefd") != 0){
       printf(1, "mkdir irefd failed\n");
@@ -1411,6 +1434,126 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// Do fork's copy-on-write pages keep parent and child apart,
+// both for their own writes and for the kernel's?
+#define COWSZ (2*4096)  // fits in buf
+
+// Is every byte of p c?
+int
+cowcheck(char *p, int c)
+{
+  int i;
+
+  for(i = 0; i < COWSZ; i++)
+    if(p[i] != c)
+      return 0;
+  return 1;
+}
+
+// Read COWSZ bytes from fd into p, however the pipe splits them.
+int
+cowread(int fd, char *p)
+{
+  int n, m;
+
+  for(n = 0; n < COWSZ; n += m)
+    if((m = read(fd, p + n, COWSZ - n)) <= 0)
+      break;
+  return n;
+}
+
+void
+cowtest(void)
+{
+  int tochild[2], toparent[2], pid, n;
+  char *p, ok;
+
+  printf(stdout, "cow test\n");
+  if(pipe(tochild) < 0 || pipe(toparent) < 0){
+    printf(stdout, "cow test pipe failed\n");
+    exit();
+  }
+  p = sbrk(COWSZ);
+  memset(p, 'a', COWSZ);
+
+  // Each side writes the same pages in turn, then checks
+  // that it still sees its own bytes.
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    ok = cowcheck(p, 'a');
+    memset(p, 'c', COWSZ);
+    write(toparent[1], &ok, 1);
+    read(tochild[0], &ok, 1);
+    ok = cowcheck(p, 'c');
+    write(toparent[1], &ok, 1);
+    exit();
+  }
+  read(toparent[0], &ok, 1);
+  if(!ok || !cowcheck(p, 'a')){
+    printf(stdout, "cow test: child's write seen by parent\n");
+    exit();
+  }
+  memset(p, 'p', COWSZ);
+  write(tochild[1], &ok, 1);
+  read(toparent[0], &ok, 1);
+  wait();
+  if(!ok || !cowcheck(p, 'p')){
+    printf(stdout, "cow test: parent's write seen by child\n");
+    exit();
+  }
+
+  // The kernel writes a copy-on-write page for read().
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    n = cowread(tochild[0], p);
+    ok = n == COWSZ && cowcheck(p, 'c');
+    write(toparent[1], &ok, 1);
+    exit();
+  }
+  memset(buf, 'c', COWSZ);
+  write(tochild[1], buf, COWSZ);
+  read(toparent[0], &ok, 1);
+  wait();
+  if(!ok){
+    printf(stdout, "cow test: read into child's page failed\n");
+    exit();
+  }
+  if(!cowcheck(p, 'p')){
+    printf(stdout, "cow test: child's read seen by parent\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    write(toparent[1], buf, COWSZ);
+    exit();
+  }
+  n = cowread(toparent[0], p);
+  wait();
+  if(n != COWSZ || !cowcheck(p, 'c')){
+    printf(stdout, "cow test: read into parent's page failed\n");
+    exit();
+  }
+
+  close(tochild[0]);
+  close(tochild[1]);
+  close(toparent[0]);
+  close(toparent[1]);
+  sbrk(-COWSZ);
+  printf(stdout, "cow test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1473,6 +1616,21 @@ sbrktest(void)
     exit();
   }
 
+  // is the freed page gone?
+  ppid = getpid();
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    a = sbrk(0);
+    printf(stdout, "oops could read freed %x = %x\n", a, *a);
+    kill(ppid);
+    exit();
+  }
+  wait();
+
   // can one re-allocate that page?
   a = sbrk(0);
   c = sbrk(4096);
@@ -1546,6 +1704,428 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// Touching p must kill a forked child.
+void
+mmapgone(char *p, char *what)
+{
+  int pid, ppid;
+
+  ppid = getpid();
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "mmap test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    printf(stdout, "oops could read %s %x = %x\n", what, p, *p);
+    kill(ppid);
+    exit();
+  }
+  wait();
+}
+
+void
+mmaptest(void)
+{
+  int fd, i, pid, n;
+  char *p, *q, *brk;
+
+  printf(stdout, "mmap test\n");
+
+  // Anonymous memory is zero, and above the heap.
+  p = mmap(0, 4*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  brk = sbrk(0);
+  if(p == MAP_FAILED || p < brk){
+    printf(stdout, "mmap anon failed\n");
+    exit();
+  }
+  for(i = 0; i < 4*4096; i++)
+    if(p[i] != 0){
+      printf(stdout, "mmap anon not zero\n");
+      exit();
+    }
+  for(i = 0; i < 4; i++)
+    p[i*4096] = 'a' + i;
+
+  // The heap may not grow into a mapping.
+  n = p - brk;
+  if(n > 0 && sbrk(n + 4096) != (char*)-1){
+    printf(stdout, "sbrk grew into a mapping\n");
+    exit();
+  }
+
+  // Trim both ends, then split what is left.
+  if(munmap(p, 4096) < 0 || munmap(p + 3*4096, 4096) < 0){
+    printf(stdout, "munmap trim failed\n");
+    exit();
+  }
+  if(p[4096] != 'b' || p[2*4096] != 'c'){
+    printf(stdout, "munmap trim lost data\n");
+    exit();
+  }
+  mmapgone(p, "trimmed start");
+  mmapgone(p + 3*4096, "trimmed end");
+  munmap(p + 4096, 2*4096);
+
+  p = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap anon failed\n");
+    exit();
+  }
+  for(i = 0; i < 3; i++)
+    p[i*4096] = 'a' + i;
+  if(munmap(p + 4096, 4096) < 0){
+    printf(stdout, "munmap split failed\n");
+    exit();
+  }
+  if(p[0] != 'a' || p[2*4096] != 'c'){
+    printf(stdout, "munmap split lost data\n");
+    exit();
+  }
+  mmapgone(p + 4096, "split hole");
+  munmap(p, 3*4096);
+
+  // After fork, shared pages are seen by both; private are not.
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(p == MAP_FAILED || q == MAP_FAILED){
+    printf(stdout, "mmap anon failed\n");
+    exit();
+  }
+  p[0] = q[0] = 'p';
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "mmap test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(p[0] != 'p' || q[0] != 'p')
+      printf(stdout, "mmap fork: child lost data\n");
+    p[0] = q[0] = 'c';
+    exit();
+  }
+  wait();
+  if(p[0] != 'c' || q[0] != 'p'){
+    printf(stdout, "mmap fork: shared %c private %c\n", p[0], q[0]);
+    exit();
+  }
+  munmap(p, 4096);
+  munmap(q, 4096);
+
+  // Writes to a shared file mapping reach the file; writes to
+  // a private one do not.
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "create mmapfile failed\n");
+    exit();
+  }
+  memset(buf, 'a', 2*4096);
+  if(write(fd, buf, 2*4096) != 2*4096){
+    printf(stdout, "write mmapfile failed\n");
+    exit();
+  }
+  p = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || q == MAP_FAILED){
+    printf(stdout, "mmap mmapfile failed\n");
+    exit();
+  }
+  if(p[4096] != 'a' || q[4096] != 'a'){
+    printf(stdout, "mmap mmapfile read wrong data\n");
+    exit();
+  }
+  q[0] = q[4096+1] = 'q';
+  p[0] = p[4096+5] = 'x';
+  munmap(q, 2*4096);
+  munmap(p, 2*4096);
+  close(fd);
+  fd = open("mmapfile", 0);
+  if(fd < 0 || read(fd, buf, 2*4096) != 2*4096){
+    printf(stdout, "read mmapfile failed\n");
+    exit();
+  }
+  close(fd);
+  if(buf[0] != 'x' || buf[4096+5] != 'x' || buf[4096+1] != 'a'){
+    printf(stdout, "mmap shared writeback wrong\n");
+    exit();
+  }
+  unlink("mmapfile");
+
+  printf(stdout, "mmap test OK\n");
+}
+
+// Thread state for threadtest; threads share it with main.
+volatile int tflag, tret, tfd;
+volatile int tturn;
+int tfds[2];
+struct mutex tlock;
+int tcount;
+
+void
+tstore(void *a1, void *a2)
+{
+  *(int*)a1 = (int)a2;
+  exit();
+}
+
+void
+tcounter(void *a1, void *a2)
+{
+  int i;
+
+  for(i = 0; i < 2000; i++){
+    mutex_lock(&tlock);
+    tcount++;
+    mutex_unlock(&tlock);
+  }
+  exit();
+}
+
+// Take turns with main: wait for tturn to be me, then pass it on.
+void
+tpingpong(void *a1, void *a2)
+{
+  int i;
+
+  for(i = 0; i < 500; i++){
+    while(tturn != 1)
+      futex((int*)&tturn, FUTEX_WAIT, 0);
+    tturn = 0;
+    futex((int*)&tturn, FUTEX_WAKE, 1);
+  }
+  exit();
+}
+
+void
+tdupclose(void *a1, void *a2)
+{
+  tfd = dup(tfds[1]);
+  close(tfds[1]);
+  exit();
+}
+
+void
+tread(void *a1, void *a2)
+{
+  tflag = 1;
+  tret = read(tfds[0], a1, (int)a2);
+  exit();
+}
+
+// Touch p until it goes away underneath.
+void
+ttouch(void *a1, void *a2)
+{
+  volatile char *p = a1;
+
+  for(;;){
+    p[0]++;
+    tflag = 1;
+  }
+}
+
+// Start fcn on a thread that does not return, or die.
+int
+tstart(void (*fcn)(void*, void*), void *a1, void *a2)
+{
+  int pid;
+
+  tflag = 0;
+  if((pid = kthread_create(fcn, a1, a2)) < 0){
+    printf(stdout, "kthread_create failed\n");
+    exit();
+  }
+  return pid;
+}
+
+void
+threadtest(void)
+{
+  char *stack, *stacks[4], *oldbrk, *p;
+  void *ustack;
+  int i, j, pid, pids[4], res[4];
+
+  printf(stdout, "thread test\n");
+
+  if(join(&ustack) != -1){
+    printf(stdout, "join with no threads succeeded\n");
+    exit();
+  }
+
+  // join returns each thread's pid and the stack it was given.
+  p = sbrk(0);
+  sbrk(4096 - (uint)p % 4096);
+  stack = sbrk(4*4096);
+  for(i = 0; i < 4; i++){
+    stacks[i] = stack + i*4096;
+    res[i] = 0;
+    pids[i] = clone(tstore, &res[i], (void*)(i+1), stacks[i]);
+    if(pids[i] < 0){
+      printf(stdout, "clone failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++){
+    pid = join(&ustack);
+    for(j = 0; j < 4; j++)
+      if(pid > 0 && pids[j] == pid)
+        break;
+    if(j == 4 || ustack != stacks[j]){
+      printf(stdout, "join returned pid %d stack %x\n", pid, ustack);
+      exit();
+    }
+    pids[j] = -1;
+  }
+  for(i = 0; i < 4; i++)
+    if(res[i] != i+1){
+      printf(stdout, "thread %d did not run\n", i);
+      exit();
+    }
+  if(join(&ustack) != -1){
+    printf(stdout, "join after last thread succeeded\n");
+    exit();
+  }
+  sbrk(-4*4096);
+
+  // Stacks handed back by join are reused, so the heap stays put.
+  tstart(tstore, &res[0], 0);
+  kthread_join();
+  oldbrk = sbrk(0);
+  for(i = 0; i < 100; i++){
+    tstart(tstore, &res[0], (void*)i);
+    if(kthread_join() < 0 || res[0] != i){
+      printf(stdout, "kthread_join failed\n");
+      exit();
+    }
+  }
+  if(sbrk(0) != oldbrk){
+    printf(stdout, "thread stacks leaked\n");
+    exit();
+  }
+
+  // No increments are lost under a futex mutex, and no
+  // wakeups are lost between futex wait and wake.
+  mutex_init(&tlock);
+  tcount = 0;
+  for(i = 0; i < 4; i++)
+    tstart(tcounter, 0, 0);
+  for(i = 0; i < 4; i++)
+    kthread_join();
+  if(tcount != 4*2000){
+    printf(stdout, "mutex lost increments: %d\n", tcount);
+    exit();
+  }
+  tturn = 0;
+  tstart(tpingpong, 0, 0);
+  for(i = 0; i < 500; i++){
+    tturn = 1;
+    futex((int*)&tturn, FUTEX_WAKE, 1);
+    while(tturn != 0)
+      futex((int*)&tturn, FUTEX_WAIT, 1);
+  }
+  kthread_join();
+
+  // Threads share one file table.
+  if(pipe(tfds) < 0){
+    printf(stdout, "pipe failed\n");
+    exit();
+  }
+  tstart(tdupclose, 0, 0);
+  kthread_join();
+  if(write(tfds[1], "x", 1) != -1){
+    printf(stdout, "write to fd closed by thread succeeded\n");
+    exit();
+  }
+  if(write(tfd, "x", 1) != 1 || read(tfds[0], buf, 1) != 1 || buf[0] != 'x'){
+    printf(stdout, "fd dup'd by thread failed\n");
+    exit();
+  }
+  // Closing an fd another thread is reading from does not
+  // pull the file out from under it.
+  tstart(tread, buf, (void*)1);
+  while(tflag == 0)
+    ;
+  sleep(2);
+  close(tfds[0]);
+  buf[0] = 0;
+  if(write(tfd, "y", 1) != 1){
+    printf(stdout, "pipe write failed\n");
+    exit();
+  }
+  kthread_join();
+  if(tret != 1 || buf[0] != 'y'){
+    printf(stdout, "read across close got %d %c\n", tret, buf[0]);
+    exit();
+  }
+  if(read(tfds[0], buf, 1) != -1){
+    printf(stdout, "read from closed fd succeeded\n");
+    exit();
+  }
+  close(tfd);
+
+  // Freeing memory a sibling is touching kills the sibling,
+  // but not memory it has lent to a system call.
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap anon failed\n");
+    exit();
+  }
+  pid = tstart(ttouch, p, 0);
+  while(tflag == 0)
+    ;
+  if(munmap(p, 4096) < 0 || kthread_join() != pid){
+    printf(stdout, "munmap under a thread failed\n");
+    exit();
+  }
+
+  // Free a stack first, so the thread's comes from below p.
+  tstart(tstore, &res[0], 0);
+  kthread_join();
+  p = sbrk(4096);
+  pid = tstart(ttouch, p, 0);
+  while(tflag == 0)
+    ;
+  if(sbrk(-4096) == (char*)-1 || kthread_join() != pid){
+    printf(stdout, "sbrk(-n) under a thread failed\n");
+    exit();
+  }
+
+  if(pipe(tfds) < 0){
+    printf(stdout, "pipe failed\n");
+    exit();
+  }
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap anon failed\n");
+    exit();
+  }
+  tstart(tread, p, (void*)10);
+  while(tflag == 0)
+    ;
+  sleep(2);
+  if(munmap(p, 4096) != -1){
+    printf(stdout, "munmap of a read buffer succeeded\n");
+    exit();
+  }
+  write(tfds[1], "0123456789", 10);
+  kthread_join();
+  for(i = 0; i < 10; i++)
+    if(p[i] != '0' + i)
+      break;
+  if(tret != 10 || i != 10){
+    printf(stdout, "read into pinned buffer failed\n");
+    exit();
+  }
+  if(munmap(p, 4096) < 0){
+    printf(stdout, "munmap after read failed\n");
+    exit();
+  }
+  close(tfds[0]);
+  close(tfds[1]);
+
+  printf(stdout, "thread test OK\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,9 +2348,13 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  cowtest();
+  mmaptest();
+  threadtest();
   validatetest();
 
   opentest();
+  textbusytest();
   writetest();
   writetest1();
   createtest();
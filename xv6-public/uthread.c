@@ -1,130 +1,443 @@
+// M:N user-level threads.
+//
+// uthread_start(nworkers, fn, arg) runs fn(arg) as the first
+// uthread on nworkers worker kernel threads (see clone) and
+// returns once every uthread has exited.
+//
+// * Each worker has a run queue and a scheduler that runs on
+//   its own stack, as in the kernel: a uthread switches to its
+//   worker's scheduler to yield or exit, and the scheduler puts
+//   it back on a queue or frees it once it is off its stack.
+// * A worker whose queue is empty steals from the others, and
+//   with nothing to steal sleeps in futex until a uthread is
+//   queued somewhere.
+// * Each worker asks for an alarm upcall every PREEMPT ticks;
+//   upreempt (uthread_switch.S) yields on behalf of the running
+//   uthread unless it is inside the runtime (nopreempt).
+// * Stacks are STACK_SIZE bytes, aligned, with the struct
+//   uthread at the bottom, so the running uthread is found from
+//   %esp.  They are carved from sbrk in chunks and pooled, so
+//   there is no limit on the number of uthreads.
+//
+// uthread_start can be called only once per process: its
+// worker kernel threads stay asleep after it returns, until the
+// process exits, and a second call returns -1.
+
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "x86.h"
+#include "futex.h"
+#include "uthread.h"
+
+#define STACK_SIZE  8192  // bytes per uthread, a power of 2
+#define STACK_CHUNK 16    // stacks taken from sbrk at once
+#define MAXWORKER   8
+#define PREEMPT     2     // ticks between preemptions
+#define PGSIZE      4096
 
 /* Possible states of a thread; */
 #define FREE        0x0
 #define RUNNING     0x1
 #define RUNNABLE    0x2
+#define ZOMBIE      0x3
 
-#define STACK_SIZE  8192
-#define MAX_THREAD  4
+#define T_THREAD    0x0   // a uthread
+#define T_SCHED     0x1   // a worker's scheduler stack
 
-typedef struct thread thread_t, *thread_p;
-typedef struct mutex mutex_t, *mutex_p;
+struct ucontext;
+struct worker;
 
-struct thread {
-  int        sp;                /* saved stack pointer */
-  char stack[STACK_SIZE];       /* the thread's stack */
-  int        state;             /* FREE, RUNNING, RUNNABLE */
+struct uthread {
+  struct ucontext *ctx;         // saved by uswtch
+  int kind;                     // T_THREAD or T_SCHED
+  int state;                    // FREE, RUNNING, RUNNABLE, ZOMBIE
+  volatile int nopreempt;       // in the runtime; do not preempt
+  struct worker *w;             // worker running it
+  void (*fn)(void*);
+  void *arg;
+  struct uthread *next;         // run queue or free list
 };
-static thread_t all_thread[MAX_THREAD];
-thread_p  current_thread;
-thread_p  next_thread;
-extern void thread_switch(void);
 
-void
-thread_init(void)
+struct worker {
+  volatile uint lock;           // protects the run queue
+  struct uthread *head;
+  struct uthread *tail;
+  struct uthread *sched;        // scheduler stack
+  int pid;
+
+  // Statistics, updated only by the worker itself.
+  uint nswitch;                 // uthreads started by the scheduler
+  uint nsteal;                  // ... taken from another worker
+  uint npreempt;                // ... that were preempted
+};
+
+static struct {
+  volatile uint lock;           // protects free
+  struct uthread *free;         // pooled stacks
+  int nworker;                  // 0 until uthread_start
+  volatile int nlive;           // uthreads not yet exited
+  volatile int seq;             // bumped when work is queued
+  volatile int nidle;           // workers asleep on seq
+  struct ucontext *mainctx;     // caller of uthread_start
+  struct worker worker[MAXWORKER];
+} rt;
+
+void uswtch(struct ucontext**, struct ucontext*);
+void upreempt(void);
+
+static void
+spinlock(volatile uint *l)
+{
+  while(xchg(l, 1) != 0)
+    ;
+}
+
+static void
+spinunlock(volatile uint *l)
+{
+  xchg(l, 0);
+}
+
+// The uthread (or scheduler) whose stack we are on.
+static struct uthread*
+self(void)
+{
+  uint sp;
+
+  asm volatile("movl %%esp, %0" : "=r" (sp));
+  return (struct uthread*)(sp & ~(STACK_SIZE-1));
+}
+
+// Keep the upcall out while t is in the runtime.  Once set,
+// t cannot move to another worker, so t->w is stable.
+static void
+enter(struct uthread *t)
 {
-  // main() is thread 0, which will make the first invocation to
-  // thread_schedule().  it needs a stack so that the first thread_switch() can
-  // save thread 0's state.  thread_schedule() won't run the main thread ever
-  // again, because its state is set to RUNNING, and thread_schedule() selects
-  // a RUNNABLE thread.
-  printf(1, "thread_init enter\n");
-  current_thread = &all_thread[0];
-  current_thread->state = RUNNING;
+  t->nopreempt = 1;
+  asm volatile("" : : : "memory");
 }
 
 static void
-thread_schedule(void)
+leave(struct uthread *t)
 {
-  thread_p t;
+  asm volatile("" : : : "memory");
+  t->nopreempt = 0;
+}
+
+//PAGEBREAK!
+// Stack pool.
 
-  /* Find another runnable thread. */
-  /* printf(1, "thread_schedule enter\n"); */
-  next_thread = 0;
-  for (t = all_thread; t < all_thread + MAX_THREAD; t++) {
-    if (t->state == RUNNABLE && t != current_thread) {
-      next_thread = t;
-      break;
+static struct uthread*
+stackalloc(int kind)
+{
+  struct uthread *t;
+  char *p;
+  int i;
+
+  spinlock(&rt.lock);
+  if(rt.free == 0){
+    // One extra stack's worth of room to align within.
+    p = sbrk((STACK_CHUNK+1) * STACK_SIZE);
+    if(p == (char*)-1){
+      spinunlock(&rt.lock);
+      return 0;
+    }
+    p = (char*)(((uint)p + STACK_SIZE-1) & ~(STACK_SIZE-1));
+    for(i = 0; i < STACK_CHUNK; i++){
+      t = (struct uthread*)(p + i*STACK_SIZE);
+      t->next = rt.free;
+      rt.free = t;
     }
   }
+  t = rt.free;
+  rt.free = t->next;
+  spinunlock(&rt.lock);
 
-  if (t >= all_thread + MAX_THREAD && current_thread->state == RUNNABLE) {
-    /* The current thread is the only runnable thread; run it. */
-    next_thread = current_thread;
-  }
+  memset(t, 0, sizeof(*t));
+  t->kind = kind;
+  return t;
+}
 
-  if (next_thread == 0) {
-    printf(2, "thread_schedule: no runnable threads\n");
-    exit();
-  }
+static void
+stackfree(struct uthread *t)
+{
+  t->state = FREE;
+  spinlock(&rt.lock);
+  t->next = rt.free;
+  rt.free = t;
+  spinunlock(&rt.lock);
+}
+
+//PAGEBREAK!
+// Run queues.
 
-  if (current_thread != next_thread) {         /* switch threads?  */
-    next_thread->state = RUNNING;
-    /* printf(1, "thread_switch called\n"); */
-    thread_switch();
-  } else
-    next_thread = 0;
+static void
+rqput(struct worker *w, struct uthread *t)
+{
+  spinlock(&w->lock);
+  t->next = 0;
+  if(w->tail)
+    w->tail->next = t;
+  else
+    w->head = t;
+  w->tail = t;
+  spinunlock(&w->lock);
 }
 
-void
-thread_create(void (*func)())
+static struct uthread*
+rqget(struct worker *w)
 {
-  thread_p t;
+  struct uthread *t;
 
-  for (t = all_thread; t < all_thread + MAX_THREAD; t++) {
-    if (t->state == FREE) break;
+  if(w->head == 0)  // no lock: a stale answer costs one pass
+    return 0;
+  spinlock(&w->lock);
+  if((t = w->head) != 0){
+    w->head = t->next;
+    if(w->head == 0)
+      w->tail = 0;
   }
-  t->sp = (int) (t->stack + STACK_SIZE);   // set sp to the top of the stack
-  t->sp -= 4;                              // space for return address
-  * (int *) (t->sp) = (int)func;           // push return address on stack
-  t->sp -= 32;                             // space for registers that thread_switch expects
-  t->state = RUNNABLE;
+  spinunlock(&w->lock);
+  return t;
 }
 
-void
-thread_yield(void)
+// Tell sleeping workers that something changed: n of them,
+// or all if n < 0.
+static void
+kick(int n)
 {
-  current_thread->state = RUNNABLE;
-  thread_schedule();
+  __sync_fetch_and_add(&rt.seq, 1);
+  if(rt.nidle > 0)
+    futex((int*)&rt.seq, FUTEX_WAKE, n < 0 ? MAXWORKER : n);
 }
 
+//PAGEBREAK!
+// Per-worker scheduler.  Returns, on worker 0 only, once all
+// uthreads have exited.
 static void
-mythread1(void)
+schedule(struct worker *w)
 {
-  int i;
-  printf(1, "my thread1 running\n");
-  for (i = 0; i < 10; i++) {
-    printf(1, "my thread1 0x%x\n", (int) current_thread);
-    thread_yield();
+  struct uthread *t, *me;
+  int seq, i;
+
+  me = w->sched;
+  for(;;){
+    seq = rt.seq;
+    t = rqget(w);
+    for(i = 1; i < rt.nworker && t == 0; i++){
+      if((t = rqget(&rt.worker[(w - rt.worker + i) % rt.nworker])) != 0)
+        w->nsteal++;
+    }
+    if(t == 0){
+      if(w == rt.worker && rt.nlive == 0)
+        return;
+      __sync_fetch_and_add(&rt.nidle, 1);
+      futex((int*)&rt.seq, FUTEX_WAIT, seq);
+      __sync_fetch_and_sub(&rt.nidle, 1);
+      continue;
+    }
+
+    t->w = w;
+    t->state = RUNNING;
+    w->nswitch++;
+    uswtch(&me->ctx, t->ctx);
+
+    // t is off its stack now.
+    if(t->state == ZOMBIE)
+      stackfree(t);
+    else {
+      rqput(w, t);
+      kick(1);
+    }
   }
-  printf(1, "my thread1: exit\n");
-  current_thread->state = FREE;
-  thread_schedule();
+}
+
+// Every scheduler starts here, on its own stack.
+static void
+schedmain(void)
+{
+  struct worker *w;
+
+  w = self()->w;
+  w->pid = getpid();
+  alarm(PREEMPT, upreempt);
+  schedule(w);
+
+  // Worker 0: back to uthread_start.
+  alarm(0, 0);
+  uswtch(&self()->ctx, rt.mainctx);
 }
 
 static void
-mythread2(void)
+workermain(void *arg1, void *arg2)
 {
+  schedmain();
+  exit();
+}
+
+// Every uthread starts here.
+static void
+uthreadmain(void)
+{
+  struct uthread *t;
+
+  t = self();
+  leave(t);
+  t->fn(t->arg);
+  uthread_exit();
+}
+
+// Make t start at fn on its own stack when first switched to.
+static void
+setentry(struct uthread *t, void (*fn)(void))
+{
+  uint *sp;
+
+  sp = (uint*)((char*)t + STACK_SIZE);
+  *--sp = 0xffffffff;   // fake return PC; fn never returns
+  *--sp = (uint)fn;     // return address for uswtch
+  *--sp = 0;            // ebp
+  *--sp = 0;            // ebx
+  *--sp = 0;            // esi
+  *--sp = 0;            // edi
+  t->ctx = (struct ucontext*)sp;
+}
+
+static struct uthread*
+spawn(void (*fn)(void*), void *arg)
+{
+  struct uthread *t;
+
+  if((t = stackalloc(T_THREAD)) == 0)
+    return 0;
+  t->fn = fn;
+  t->arg = arg;
+  t->nopreempt = 1;     // until uthreadmain
+  t->state = RUNNABLE;
+  setentry(t, uthreadmain);
+  __sync_fetch_and_add(&rt.nlive, 1);
+  return t;
+}
+
+//PAGEBREAK!
+// Interface.
+
+int
+uthread_start(int nworkers, void (*fn)(void*), void *arg)
+{
+  struct worker *w;
+  struct uthread *t;
   int i;
-  printf(1, "my thread2 running\n");
-  for (i = 0; i < 10; i++) {
-    printf(1, "my thread2 0x%x\n", (int) current_thread);
-    thread_yield();
+
+  if(rt.nworker != 0)
+    return -1;
+  if(nworkers < 1)
+    nworkers = 1;
+  if(nworkers > MAXWORKER)
+    nworkers = MAXWORKER;
+  rt.nworker = nworkers;
+  for(i = 0; i < nworkers; i++){
+    w = &rt.worker[i];
+    if((w->sched = stackalloc(T_SCHED)) == 0){
+      printf(2, "uthread_start: out of memory\n");
+      exit();
+    }
+    w->sched->w = w;
+  }
+  if((t = spawn(fn, arg)) == 0){
+    printf(2, "uthread_start: out of memory\n");
+    exit();
+  }
+  rqput(&rt.worker[0], t);
+
+  for(i = 1; i < nworkers; i++){
+    w = &rt.worker[i];
+    if(clone(workermain, 0, 0, (char*)w->sched + STACK_SIZE - PGSIZE) < 0){
+      printf(2, "uthread_start: clone failed\n");
+      exit();
+    }
   }
-  printf(1, "my thread2: exit\n");
-  current_thread->state = FREE;
-  thread_schedule();
+
+  // Become worker 0's scheduler until everything is done.
+  setentry(rt.worker[0].sched, schedmain);
+  uswtch(&rt.mainctx, rt.worker[0].sched->ctx);
+  return 0;
 }
 
+// Create a uthread running fn(arg), queued on the caller's
+// worker.  Returns 0 if out of memory.
+struct uthread*
+uthread_create(void (*fn)(void*), void *arg)
+{
+  struct uthread *me, *t;
+
+  me = self();
+  enter(me);
+  if((t = spawn(fn, arg)) != 0){
+    rqput(me->w, t);
+    kick(1);
+  }
+  leave(me);
+  return t;
+}
+
+void
+uthread_yield(void)
+{
+  struct uthread *t;
+
+  t = self();
+  enter(t);
+  t->state = RUNNABLE;
+  uswtch(&t->ctx, t->w->sched->ctx);
+  leave(t);
+}
+
+void
+uthread_exit(void)
+{
+  struct uthread *t;
+
+  t = self();
+  enter(t);
+  t->state = ZOMBIE;
+  if(__sync_sub_and_fetch(&rt.nlive, 1) == 0)
+    kick(-1);  // worker 0 may be asleep
+  uswtch(&t->ctx, t->w->sched->ctx);
+  for(;;)
+    ;
+}
+
+// Index of the worker running the caller.
 int
-main(int argc, char *argv[])
+uthread_worker(void)
 {
-  thread_init();
-  thread_create(mythread1);
-  thread_create(mythread2);
-  thread_schedule();
-  return 0;
+  return self()->w - rt.worker;
+}
+
+// Called by upreempt from the timer upcall.
+void
+uthread_preempt(void)
+{
+  struct uthread *t;
+
+  t = self();
+  if(t->kind != T_THREAD || t->nopreempt)
+    return;
+  enter(t);
+  t->w->npreempt++;
+  t->state = RUNNABLE;
+  uswtch(&t->ctx, t->w->sched->ctx);
+  leave(t);
+}
+
+void
+uthread_stats(void)
+{
+  struct worker *w;
+
+  for(w = rt.worker; w < &rt.worker[rt.nworker]; w++)
+    printf(1, "worker %d (pid %d): switch %d steal %d preempt %d\n",
+           w - rt.worker, w->pid, w->nswitch, w->nsteal, w->npreempt);
 }
@@ -0,0 +1,11 @@
+// M:N user threads: many uthreads multiplexed on a few worker
+// kernel threads (see uthread.c).
+
+struct uthread;
+
+int             uthread_start(int, void(*)(void*), void*);
+struct uthread* uthread_create(void(*)(void*), void*);
+void            uthread_yield(void);
+void            uthread_exit(void) __attribute__((noreturn));
+int             uthread_worker(void);
+void            uthread_stats(void);
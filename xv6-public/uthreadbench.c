@@ -0,0 +1,113 @@
+// Measure the uthread runtime.
+// Runs on nworkers workers (default 1):
+//  - switch: two uthreads yield to each other N times, giving
+//    the cost of a user-level context switch;
+//  - spawn: creates ntasks short uthreads (default 10000),
+//    SPAWNBATCH at a time so their stacks are reused, giving
+//    task throughput and, with several workers, how well
+//    stealing spreads them;
+//  - preempt: uthreads that never yield must still all finish
+//    their slice of work, by timer preemption.
+// Run it with CPUS >= nworkers.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "uthread.h"
+
+#define N      100000  // yields per uthread in the switch test
+#define NSPIN  4       // busy uthreads in the preempt test
+#define SPAWNBATCH 100 // uthreads alive at once in the spawn test
+
+int ntasks;
+volatile int nyielders;
+volatile int done;
+volatile int spinning;
+
+void
+yielder(void *arg)
+{
+  int i;
+
+  for(i = 0; i < N; i++)
+    uthread_yield();
+  __sync_fetch_and_add(&nyielders, 1);
+}
+
+void
+task(void *arg)
+{
+  volatile int i;
+
+  for(i = 0; i < 100; i++)
+    ;
+  __sync_fetch_and_add(&done, 1);
+}
+
+void
+spinner(void *arg)
+{
+  // Wait until all spinners have started; without preemption
+  // the first one would hold its worker forever.
+  __sync_fetch_and_add(&spinning, 1);
+  while(spinning < NSPIN)
+    ;
+}
+
+void
+bench(void *arg)
+{
+  int i, j, n, t0, t1;
+
+  t0 = uptime();
+  uthread_create(yielder, 0);
+  uthread_create(yielder, 0);
+  // Wait for the yielders, yielding too.
+  for(n = 2*N; nyielders < 2; n++)
+    uthread_yield();
+  t1 = uptime();
+  if(t1 == t0)
+    t1++;
+  printf(1, "uthreadbench: switch: %d yields in %d ticks, %d yields/tick\n",
+         n, t1-t0, n/(t1-t0));
+
+  t0 = uptime();
+  for(i = 0; i < ntasks; i = j){
+    for(j = i; j < ntasks && j < i + SPAWNBATCH; j++)
+      if(uthread_create(task, 0) == 0){
+        printf(2, "uthreadbench: uthread_create failed\n");
+        exit();
+      }
+    while(done < j)
+      uthread_yield();
+  }
+  t1 = uptime();
+  if(t1 == t0)
+    t1++;
+  printf(1, "uthreadbench: spawn: %d tasks in %d ticks, %d tasks/tick\n",
+         ntasks, t1-t0, ntasks/(t1-t0));
+
+  for(i = 0; i < NSPIN; i++)
+    uthread_create(spinner, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nworkers;
+
+  nworkers = 1;
+  if(argc > 1)
+    nworkers = atoi(argv[1]);
+  ntasks = 10000;
+  if(argc > 2)
+    ntasks = atoi(argv[2]);
+
+  if(uthread_start(nworkers, bench, 0) < 0){
+    printf(2, "uthreadbench: uthread_start failed\n");
+    exit();
+  }
+  printf(1, "uthreadbench: preempt: %d spinners finished\n", spinning);
+  uthread_stats();
+  exit();
+}
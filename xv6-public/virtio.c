@@ -0,0 +1,403 @@
+// Driver for a legacy virtio-blk PCI device, in place of ide.c
+// (build with DISK=VIRTIO).  It serves the file system disk,
+// ROOTDEV; the boot disk stays on IDE, for the boot loader.
+//
+// Requests go to the device through one virtqueue: a table of
+// descriptors, an avail ring the driver adds requests to, and a
+// used ring the device returns them on.  Each request is a
+// chain of three descriptors (header, data, status byte), so
+// up to num/3 are in flight at once; bufs that find no free
+// descriptors wait on vdisk.pending.  Data moves by DMA, with
+// no port I/O per word as with IDE.
+//
+// Interrupts are coalesced: the interrupt handler masks the
+// device's interrupts while it empties the used ring, so that
+// requests that finish meanwhile cost no further interrupts,
+// then unmasks them and looks once more.  Likewise the device
+// tells us when it is already processing the avail ring, and
+// then iderw_start does not notify it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SECTOR_SIZE   512
+
+// PCI configuration space.
+#define PCI_ADDR      0xcf8
+#define PCI_DATA      0xcfc
+#define PCI_ID        0x00   // vendor, device
+#define PCI_CMD       0x04
+#define PCI_BAR0      0x10
+#define PCI_INTR      0x3c   // interrupt line
+#define PCI_CMD_IO    0x1
+#define PCI_CMD_MASTER 0x4
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLKDEV 0x1001   // legacy (transitional) block device
+
+// Legacy virtio registers, at the I/O port in BAR0.
+#define VIRTIO_HOSTFEAT  0x00
+#define VIRTIO_GUESTFEAT 0x04
+#define VIRTIO_QPFN      0x08
+#define VIRTIO_QSIZE     0x0c
+#define VIRTIO_QSEL      0x0e
+#define VIRTIO_QNOTIFY   0x10
+#define VIRTIO_STATUS    0x12
+#define VIRTIO_ISR       0x13
+
+#define STATUS_ACK       1
+#define STATUS_DRIVER    2
+#define STATUS_DRIVER_OK 4
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2   // device writes this buffer
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY  1
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+
+#define NQMAX         256   // largest queue we have room for
+#define VRALIGN(x)    (((x) + PGSIZE-1) & ~(PGSIZE-1))
+#define VRSIZE(n)     (VRALIGN(16*(n) + 6 + 2*(n)) + VRALIGN(6 + 8*(n)))
+
+struct vdesc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vusedelem {
+  uint id;    // head of the descriptor chain
+  uint len;
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct vusedelem ring[];
+};
+
+// A request in flight, indexed by its first descriptor.
+struct vreq {
+  uint type;
+  uint reserved;
+  uint sector;
+  uint sectorhi;
+  struct buf *b;
+  uchar status;
+} __attribute__((aligned(32)));
+
+// The virtqueue must be physically contiguous and page aligned,
+// so it lives in the kernel's data, not in kalloc'd pages.
+static char vqmem[VRSIZE(NQMAX)] __attribute__((aligned(PGSIZE)));
+
+// You must hold vdisk.lock while using the queue.
+static struct {
+  struct spinlock lock;
+  ushort iobase;
+  uint num;                 // entries in the queue
+  struct vdesc *desc;
+  struct vavail *avail;
+  struct vused *used;
+  ushort freedesc;          // free descriptors, linked by next
+  uint nfree;
+  ushort usedidx;           // used entries handled so far
+  struct buf *pending;      // waiting for descriptors
+  struct buf **pendtail;
+  struct vreq req[NQMAX];
+
+  // Statistics.
+  uint nreq;                // requests issued
+  uint nnotify;             // ... that needed a notify
+  uint nintr;               // interrupts
+} vdisk;
+
+static int havedisk;
+
+static uint
+pciread(int dev, int reg)
+{
+  outl(PCI_ADDR, 0x80000000 | (dev << 11) | reg);
+  return inl(PCI_DATA);
+}
+
+static void
+pciwrite(int dev, int reg, uint v)
+{
+  outl(PCI_ADDR, 0x80000000 | (dev << 11) | reg);
+  outl(PCI_DATA, v);
+}
+
+// Find the virtio-blk device on PCI bus 0 and set it up.
+void
+ideinit(void)
+{
+  int dev, irq;
+  uint bar, n;
+  char *p;
+
+  initlock(&vdisk.lock, "virtio");
+  vdisk.pendtail = &vdisk.pending;
+  for(dev = 0; dev < 32; dev++)
+    if(pciread(dev, PCI_ID) == (VIRTIO_BLKDEV << 16 | VIRTIO_VENDOR))
+      break;
+  if(dev == 32){
+    cprintf("virtio: no disk\n");
+    return;
+  }
+  bar = pciread(dev, PCI_BAR0);
+  if((bar & 1) == 0)
+    panic("virtio: BAR0 not I/O");
+  vdisk.iobase = bar & ~3;
+  pciwrite(dev, PCI_CMD, pciread(dev, PCI_CMD) | PCI_CMD_IO | PCI_CMD_MASTER);
+  irq = pciread(dev, PCI_INTR) & 0xff;
+
+  // Reset, then negotiate no optional features.
+  outb(vdisk.iobase + VIRTIO_STATUS, 0);
+  outb(vdisk.iobase + VIRTIO_STATUS, STATUS_ACK);
+  outb(vdisk.iobase + VIRTIO_STATUS, STATUS_ACK | STATUS_DRIVER);
+  inl(vdisk.iobase + VIRTIO_HOSTFEAT);
+  outl(vdisk.iobase + VIRTIO_GUESTFEAT, 0);
+
+  // Queue 0; legacy devices fix its size.
+  outw(vdisk.iobase + VIRTIO_QSEL, 0);
+  n = inw(vdisk.iobase + VIRTIO_QSIZE);
+  if(n == 0 || n > NQMAX || (n & (n-1)) != 0)
+    panic("virtio: queue size");
+  vdisk.num = n;
+  p = vqmem;
+  memset(p, 0, VRSIZE(n));
+  vdisk.desc = (struct vdesc*)p;
+  vdisk.avail = (struct vavail*)(p + 16*n);
+  vdisk.used = (struct vused*)(p + VRALIGN(16*n + 6 + 2*n));
+  for(n = 0; n < vdisk.num; n++)
+    vdisk.desc[n].next = n + 1;
+  vdisk.freedesc = 0;
+  vdisk.nfree = vdisk.num;
+  outl(vdisk.iobase + VIRTIO_QPFN, V2P(p) >> PGSHIFT);
+
+  outb(vdisk.iobase + VIRTIO_STATUS,
+       STATUS_ACK | STATUS_DRIVER | STATUS_DRIVER_OK);
+  ioapicroute(irq, T_IRQ0 + IRQ_IDE, ncpu - 1);
+  havedisk = 1;
+}
+
+static ushort
+allocdesc(void)
+{
+  ushort d;
+
+  d = vdisk.freedesc;
+  vdisk.freedesc = vdisk.desc[d].next;
+  vdisk.nfree--;
+  return d;
+}
+
+static void
+freedesc(ushort d)
+{
+  vdisk.desc[d].next = vdisk.freedesc;
+  vdisk.freedesc = d;
+  vdisk.nfree++;
+}
+
+// Put b on the avail ring.  Caller holds vdisk.lock and has
+// checked that there are three free descriptors.
+static void
+vstart(struct buf *b)
+{
+  struct vreq *r;
+  struct vdesc *d;
+  ushort d0, d1, d2;
+
+  if(b->blockno >= FSSIZE)
+    panic("incorrect blockno");
+  d0 = allocdesc();
+  d1 = allocdesc();
+  d2 = allocdesc();
+
+  r = &vdisk.req[d0];
+  r->type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  r->reserved = 0;
+  r->sector = b->blockno * (BSIZE/SECTOR_SIZE);
+  r->sectorhi = 0;
+  r->b = b;
+  r->status = 0xff;
+
+  d = &vdisk.desc[d0];
+  d->addr = V2P(r);
+  d->len = 16;
+  d->flags = VRING_DESC_F_NEXT;
+  d->next = d1;
+  d = &vdisk.desc[d1];
+  d->addr = V2P(b->data);
+  d->len = BSIZE;
+  d->flags = VRING_DESC_F_NEXT;
+  if(!(b->flags & B_DIRTY))
+    d->flags |= VRING_DESC_F_WRITE;
+  d->next = d2;
+  d = &vdisk.desc[d2];
+  d->addr = V2P(&r->status);
+  d->len = 1;
+  d->flags = VRING_DESC_F_WRITE;
+
+  vdisk.avail->ring[vdisk.avail->idx % vdisk.num] = d0;
+  __sync_synchronize();
+  vdisk.avail->idx++;
+  vdisk.nreq++;
+}
+
+// Tell the device about new requests, unless it is already
+// working through the ring.  Caller holds vdisk.lock.
+static void
+vnotify(void)
+{
+  __sync_synchronize();
+  if(vdisk.used->flags & VRING_USED_F_NO_NOTIFY)
+    return;
+  vdisk.nnotify++;
+  outw(vdisk.iobase + VIRTIO_QNOTIFY, 0);
+}
+
+// Start as many pending bufs as there are descriptors for.
+// Caller holds vdisk.lock.
+static int
+vstartpending(void)
+{
+  struct buf *b;
+  int n;
+
+  for(n = 0; (b = vdisk.pending) != 0 && vdisk.nfree >= 3; n++){
+    if((vdisk.pending = b->qnext) == 0)
+      vdisk.pendtail = &vdisk.pending;
+    vstart(b);
+  }
+  return n;
+}
+
+// Interrupt handler.
+void
+ideintr(void)
+{
+  struct buf *b, *done;
+  struct vreq *r;
+  ushort d;
+
+  if(!havedisk)
+    return;
+  acquire(&vdisk.lock);
+  inb(vdisk.iobase + VIRTIO_ISR);  // acknowledge; lowers the line
+  vdisk.nintr++;
+
+  done = 0;
+  for(;;){
+    vdisk.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    __sync_synchronize();
+    while(vdisk.usedidx != vdisk.used->idx){
+      __sync_synchronize();
+      d = vdisk.used->ring[vdisk.usedidx % vdisk.num].id;
+      vdisk.usedidx++;
+      r = &vdisk.req[d];
+      if(r->status != 0)
+        panic("virtio: disk error");
+      b = r->b;
+      freedesc(vdisk.desc[vdisk.desc[d].next].next);
+      freedesc(vdisk.desc[d].next);
+      freedesc(d);
+
+      b->flags |= B_VALID;
+      b->flags &= ~B_DIRTY;
+      if(b->flags & B_ASYNC){
+        b->qnext = done;
+        done = b;
+      } else
+        wakeup(b);
+    }
+    if(vstartpending() > 0)
+      vnotify();
+
+    // Unmask, then catch what finished before we did.
+    vdisk.avail->flags = 0;
+    __sync_synchronize();
+    if(vdisk.usedidx == vdisk.used->idx)
+      break;
+  }
+  release(&vdisk.lock);
+
+  // Release buffers nobody is waiting for, outside vdisk.lock.
+  while((b = done) != 0){
+    done = b->qnext;
+    biodone(b);
+  }
+}
+
+//PAGEBREAK!
+// Queue b for the disk and return without waiting.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// The caller must keep b locked until iderw_wait(b) returns.
+void
+iderw_start(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("iderw: buf not locked");
+  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+    panic("iderw: nothing to do");
+  if(b->dev != ROOTDEV || !havedisk)
+    panic("iderw: no virtio disk");
+
+  acquire(&vdisk.lock);
+  b->qnext = 0;
+  *vdisk.pendtail = b;
+  vdisk.pendtail = &b->qnext;
+  if(vstartpending() > 0)
+    vnotify();
+  release(&vdisk.lock);
+}
+
+// Wait for a request queued by iderw_start to finish.
+void
+iderw_wait(struct buf *b)
+{
+  acquire(&vdisk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
+    sleep(b, &vdisk.lock);
+  }
+  release(&vdisk.lock);
+}
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  iderw_start(b);
+  iderw_wait(b);
+}
+
+// Print disk statistics to the console.
+void
+idedump(void)
+{
+  cprintf("virtio: %d requests, %d notifies, %d interrupts\n",
+          vdisk.nreq, vdisk.nnotify, vdisk.nintr);
+}
@@ -4,11 +4,17 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
+#include "traps.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
+static struct spinlock cowlock;  // threads sharing a page table may fault together
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
@@ -141,6 +147,7 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  initlock(&cowlock, "cow");
   kpgdir = setupkvm();
   switchkvm();
 }
@@ -250,19 +257,25 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
+#define NGATHER 32  // pages deallocuvm unmaps per TLB shootdown
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size.  Pages are freed
+// NGATHER at a time, once no CPU's TLB maps them (see tlbflush).
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
   pte_t *pte;
   uint a, pa;
+  char *gather[NGATHER];
+  int n;
 
   if(newsz >= oldsz)
     return oldsz;
 
+  n = 0;
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
@@ -272,11 +285,20 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      gather[n++] = P2V(pa);
       *pte = 0;
+      if(n == NGATHER){
+        tlbflush(pgdir);
+        while(n > 0)
+          kfree(gather[--n]);
+      }
     }
   }
+  if(n > 0){
+    tlbflush(pgdir);
+    while(n > 0)
+      kfree(gather[--n]);
+  }
   return newsz;
 }
 
@@ -312,38 +334,498 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
+// Give the child page table d its own copy of the page of pte
+// at va, for fork.  Pages that another thread's system call
+// has pinned (see argptr) are copied rather than made
+// copy-on-write, since the kernel writes them without faulting.
+static int
+forkcopy(pde_t *d, uint va, pte_t *pte)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+  if(mappages(d, (void*)va, PGSIZE, V2P(mem), PTE_FLAGS(*pte) & ~PTE_D) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Given a parent process p, create a copy of its page
+// table for a child.  Pages are not copied (but see
+// forkcopy): parent and child share them, with writable
+// pages turned read-only and marked PTE_COW, and cowcopy()
+// copies a page when either side first writes it.  p's page
+// table must be the
+// current one, since its PTEs change.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(struct proc *p)
 {
-  pde_t *d;
+  pde_t *d, *pgdir;
   pte_t *pte;
   uint pa, i, flags;
-  char *mem;
 
+  pgdir = p->pgdir;
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = 0; i < p->sz; i += PGSIZE){
+    // Heap pages are allocated lazily (see handle_page_fault),
+    // so pages the parent never touched are simply not there.
     if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+      continue;
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    if((*pte & PTE_W) && vmpinned(p, i, i + PGSIZE)){
+      if(forkcopy(d, i, pte) < 0)
+        goto bad;
+      continue;
+    }
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0)
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
+    kref(P2V(pa));
   }
+  tlbflush(pgdir);  // flush the parent's now read-only TLB entries
   return d;
 
 bad:
+  tlbflush(pgdir);
   freevm(d);
   return 0;
 }
 
+// Give pgdir a private, writable copy of the copy-on-write
+// page at va.  If no one else shares the page any more, just
+// make it writable again.  Returns 0 on success, -1 if va is
+// not a COW page or memory runs out.  A thread that faults
+// on a page another thread has just copied finds it writable
+// and succeeds too.
+int
+cowcopy(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem, *old;
+  int r;
+
+  va = PGROUNDDOWN(va);
+  if(va >= KERNBASE)
+    return -1;
+  old = 0;
+  acquire(&cowlock);
+  r = -1;
+  if((pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    goto out;
+  if((*pte & (PTE_P|PTE_U|PTE_W)) == (PTE_P|PTE_U|PTE_W)){
+    r = 0;
+    goto out;
+  }
+  if((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+    goto out;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcount(P2V(pa)) == 1){
+    *pte = pa | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      goto out;
+    memmove(mem, (char*)P2V(pa), PGSIZE);
+    *pte = V2P(mem) | flags;
+    old = P2V(pa);
+  }
+  r = 0;
+out:
+  release(&cowlock);
+  invlpg((void*)va);
+  if(old){
+    // Other threads' CPUs may still map the old page.
+    tlbflush(pgdir);
+    kfree(old);
+  }
+  return r;
+}
+
+//PAGEBREAK!
+// Demand paging.
+
+// Fill in the page at va of the region v of p.  Pages of
+// an exec segment inside the file come from the page cache,
+// shared read-only or copy-on-write; a write fault takes a
+// private copy at once.  A page of an mmap region gets its
+// own copy read through the buffer cache: a shared region's
+// writes must reach the file, and data files, read once,
+// would only push programs out of the small page cache.
+// Reading the file may sleep, so the caller must not hold
+// a spinlock.
+static int
+vmafault(struct proc *p, struct vma *v, uint va, int write)
+{
+  uint pos, n, perm;
+  char *mem, *page;
+  pte_t *pte;
+  int locked;
+
+  pushcli();
+  locked = mycpu()->ncli > 1;
+  popcli();
+
+  pos = va - v->start;
+  perm = PTE_U;
+  if(v->flags & VMA_WRITE)
+    perm |= PTE_W;
+  if(pos >= v->filesz){
+    // Past the end of the file data, e.g. bss.
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+  } else {
+    if(locked)
+      panic("vmfault: file page with lock held");
+    n = v->filesz - pos;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    if(v->flags & VMA_MMAP){
+      if((mem = kalloc()) == 0)
+        return -1;
+      memset(mem, 0, PGSIZE);
+      ilock(v->ip);
+      readi(v->ip, mem, v->off + pos, n);  // short if the file shrank
+      iunlock(v->ip);
+    } else if((mem = pcget(v->ip, v->off + pos, n)) == 0)
+      return -1;
+    else if(perm & PTE_W){
+      if(write){
+        if((page = kalloc()) == 0){
+          kfree(mem);
+          return -1;
+        }
+        memmove(page, mem, PGSIZE);
+        kfree(mem);
+        mem = page;
+      } else
+        perm = (perm & ~PTE_W) | PTE_COW;
+    }
+  }
+
+  // Another thread may have faulted the page in while we slept.
+  if((pte = walkpgdir(p->pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P)){
+    kfree(mem);
+    return 0;
+  }
+  if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), perm) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a fault on the unmapped user page at va of p.
+// Pages of a VMA are filled in from it; other pages below
+// p->sz (heap and stack) are allocated zeroed.
+// Returns 0 on success, -1 if va is not part of p.
+int
+vmfault(struct proc *p, uint va, int write)
+{
+  struct vma *v;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return vmafault(p, v, va, write);
+  if(va >= p->sz)
+    return -1;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the pages of [va, va+n) of p that are not yet
+// mapped, so that the kernel can touch them while holding
+// spinlocks.  If write is set, also break copy-on-write, and
+// fail unless every page is writable.  System call arguments
+// go through here.
+int
+vmprefault(struct proc *p, uint va, uint n, int write)
+{
+  uint a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || !(*pte & PTE_P)){
+      if(vmfault(p, a, write) < 0)
+        return -1;
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+    }
+    if(write && !(*pte & PTE_W) &&
+       (!(*pte & PTE_COW) || cowcopy(p->pgdir, a) < 0))
+      return -1;
+  }
+  return 0;
+}
+
+// Is [va, va+n) inside a single mmap region of p?
+int
+vmarange(struct proc *p, uint va, uint n)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if((v->flags & VMA_MMAP) && va >= v->start && va + n <= v->end && va + n >= va)
+      return 1;
+  return 0;
+}
+
+// Lowest address used by p's mmap regions; the heap must
+// stay below it.
+uint
+vmalimit(struct proc *p)
+{
+  struct vma *v;
+  uint lim;
+
+  lim = KERNBASE;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if((v->flags & VMA_MMAP) && v->start < lim)
+      lim = v->start;
+  return lim;
+}
+
+// Add an mmap region of len bytes to p, filled from ip at
+// off for filesz bytes (ip may be 0 for anonymous memory).
+// Regions are placed top-down from KERNBASE in the first
+// gap that fits above the heap.  Returns the address, or -1.
+int
+vmamap(struct proc *p, uint len, int flags, struct inode *ip, uint off, uint filesz)
+{
+  struct vma *v, *nv;
+  uint top, a;
+
+  len = PGROUNDUP(len);
+  nv = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0){
+      nv = v;
+      break;
+    }
+  if(nv == 0 || len == 0)
+    return -1;
+
+  top = KERNBASE;
+again:
+  if(len > top || top - len < PGROUNDUP(p->sz))
+    return -1;
+  a = top - len;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if((v->flags & VMA_MMAP) && a < v->end && v->start < top){
+      top = v->start;
+      goto again;
+    }
+  }
+
+  nv->start = a;
+  nv->end = a + len;
+  nv->ip = ip ? idup(ip) : 0;
+  nv->off = off;
+  nv->filesz = filesz;
+  nv->flags = flags | VMA_MMAP;
+  return a;
+}
+
+// Write the dirty pages of shared region v in [start, end)
+// back to its file.  Only bytes that were in the file when
+// it was mapped are written, and never past its current end.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint start, uint end)
+{
+  int max = PGSIZE;  // fits a log reservation; see filewrite
+  uint a, pos, n, i, n1;
+  pte_t *pte;
+  char *mem;
+  int r, res;
+
+  for(a = start; a < end; a += PGSIZE){
+    pos = a - v->start;
+    if(pos >= v->filesz)
+      break;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D))
+      continue;
+    *pte &= ~PTE_D;
+    invlpg((void*)a);
+    mem = P2V(PTE_ADDR(*pte));
+    kref(mem);  // keep the page while writei sleeps
+
+    n = v->filesz - pos;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    for(i = 0; i < n; i += n1){
+      n1 = n - i;
+      if(n1 > max)
+        n1 = max;
+      res = writeblocks(n1);
+      begin_opn(res);
+      ilock(v->ip);
+      r = -1;
+      if(v->off + pos + i < v->ip->size){
+        if(n1 > v->ip->size - (v->off + pos + i))
+          n1 = v->ip->size - (v->off + pos + i);
+        r = writei(v->ip, mem + i, v->off + pos + i, n1);
+      }
+      iunlock(v->ip);
+      end_opn(res);
+      if(r != n1)
+        break;
+    }
+    kfree(mem);
+  }
+}
+
+// Remove [start, end) from p's mmap regions, writing shared
+// pages back to their files first.  A region may be cut at
+// either end or split in two.  Exec segments are left alone.
+// Returns -1, changing nothing, if a split needs a free VMA.
+int
+vmaunmap(struct proc *p, uint start, uint end)
+{
+  struct vma *v, *nv;
+  uint lo, hi, cut;
+  int nsplit, nfree;
+
+  start = PGROUNDDOWN(start);
+  end = PGROUNDUP(end);
+  nsplit = nfree = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      nfree++;
+    else if((v->flags & VMA_MMAP) && start > v->start && end < v->end)
+      nsplit++;
+  }
+  if(nsplit > nfree)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(!(v->flags & VMA_MMAP) || end <= v->start || start >= v->end)
+      continue;
+    lo = start > v->start ? start : v->start;
+    hi = end < v->end ? end : v->end;
+    if(v->ip && (v->flags & VMA_SHARED))
+      vmawriteback(p, v, lo, hi);
+    deallocuvm(p->pgdir, hi, lo);
+
+    if(lo == v->start && hi == v->end){
+      if(v->ip){
+        begin_op();
+        iput(v->ip);
+        end_op();
+      }
+      memset(v, 0, sizeof(*v));
+    } else if(lo == v->start){
+      cut = hi - v->start;
+      v->start = hi;
+      v->off += cut;
+      v->filesz = v->filesz > cut ? v->filesz - cut : 0;
+    } else {
+      if(hi < v->end){
+        for(nv = p->vma; nv->end != 0; nv++)
+          ;
+        *nv = *v;
+        cut = hi - v->start;
+        nv->start = hi;
+        nv->off += cut;
+        nv->filesz = nv->filesz > cut ? nv->filesz - cut : 0;
+        if(nv->ip)
+          idup(nv->ip);
+      }
+      v->end = lo;
+      if(v->filesz > lo - v->start)
+        v->filesz = lo - v->start;
+    }
+  }
+  lcr3(V2P(p->pgdir));
+  return 0;
+}
+
+// Map p's mmap pages into the child page table d.  Pages of
+// shared regions are shared writable, all faulted in first
+// so that parent and child see the same memory; private
+// pages become copy-on-write as in copyuvm.
+int
+vmacopy(pde_t *d, struct proc *p)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint a, pa, flags;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(!(v->flags & VMA_MMAP))
+      continue;
+    if((v->flags & VMA_SHARED) && vmprefault(p, v->start, v->end - v->start, 0) < 0)
+      return -1;
+    for(a = v->start; a < v->end; a += PGSIZE){
+      if((pte = walkpgdir(p->pgdir, (void*)a, 0)) == 0 || !(*pte & PTE_P))
+        continue;
+      if(!(v->flags & VMA_SHARED) && (*pte & PTE_W) && vmpinned(p, a, a + PGSIZE)){
+        if(forkcopy(d, a, pte) < 0)
+          return -1;
+        continue;
+      }
+      if(!(v->flags & VMA_SHARED) && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE_ADDR(*pte);
+      flags = PTE_FLAGS(*pte) & ~PTE_D;
+      if(mappages(d, (void*)a, PGSIZE, pa, flags) < 0)
+        return -1;
+      kref(P2V(pa));
+    }
+  }
+  tlbflush(p->pgdir);
+  return 0;
+}
+
+// Give np copies of p's VMAs.
+void
+vmadup(struct proc *np, struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(np->vma[i].ip)
+      idup(np->vma[i].ip);
+    if(np->vma[i].ip && !(np->vma[i].flags & VMA_MMAP))
+      itext(np->vma[i].ip, 1);
+  }
+}
+
+// Drop all of p's VMAs.  Must be called inside a
+// transaction, since it calls iput().
+void
+vmaclear(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip && !(v->flags & VMA_MMAP))
+      itext(v->ip, -1);
+    if(v->ip)
+      iput(v->ip);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -359,18 +841,45 @@ uva2ka(pde_t *pgdir, char *uva)
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
+// Like uva2ka, but for the user word at uva, and breaking
+// copy-on-write first so that the address stays the same
+// while the page is mapped.  Futexes use it as their key.
+char*
+uva2kaw(pde_t *pgdir, uint uva)
+{
+  pte_t *pte;
+  char *ka;
+
+  if(uva % 4 != 0)
+    return 0;
+  pte = walkpgdir(pgdir, (char*)uva, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+    return 0;
+  if((*pte & PTE_COW) && cowcopy(pgdir, uva) < 0)
+    return 0;
+  if((ka = uva2ka(pgdir, (char*)PGROUNDDOWN(uva))) == 0)
+    return 0;
+  return ka + (uva - PGROUNDDOWN(uva));
+}
+
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.
+// Writes through the kernel mapping bypass PTE_W, so
+// copy-on-write pages are broken here rather than by a fault.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if(pte && (*pte & PTE_COW) && cowcopy(pgdir, va0) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
@@ -391,3 +900,51 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 // Blank page.
 //PAGEBREAK!
 // Blank page.
+
+//PAGEBREAK!
+// TLB shootdown.  Threads share a page table, so when PTEs of
+// one are removed or lose write access, other CPUs running its
+// threads may still have the old entries in their TLBs.
+// tlbflush flushes this CPU's TLB if it uses pgdir, interrupts
+// those CPUs, and waits until they have reloaded %cr3; only
+// then may the pages the PTEs mapped be freed.  A CPU that
+// starts running pgdir later loads the new PTEs.  A process
+// that is not running will reload %cr3 before it runs again.
+//
+// If other CPUs use pgdir, the caller must have interrupts on
+// (hold no spin lock), since they may be spinning for a lock
+// with interrupts off, and must be able to flush our TLB while
+// we wait.
+void
+tlbflush(pde_t *pgdir)
+{
+  struct cpu *c, *me;
+  struct proc *p;
+  uint gen[NCPU];
+  int want[NCPU], intena, n;
+
+  intena = readeflags() & FL_IF;
+  __sync_synchronize();  // the PTE changes before reading c->proc
+  pushcli();
+  me = mycpu();
+  if(rcr3() == V2P(pgdir))
+    lcr3(V2P(pgdir));
+  n = 0;
+  for(c = cpus; c < cpus+ncpu; c++){
+    want[c-cpus] = 0;
+    if(c == me || (p = c->proc) == 0 || p->pgdir != pgdir || p->state != RUNNING)
+      continue;
+    if(!intena)
+      panic("tlbflush");
+    gen[c-cpus] = c->tlbgen;
+    want[c-cpus] = 1;
+    lapicipi(c->apicid, T_TLBFLUSH);
+    n++;
+  }
+  popcli();
+
+  for(c = cpus; n > 0 && c < cpus+ncpu; c++)
+    if(want[c-cpus])
+      while(c->tlbgen == gen[c-cpus])
+        ;
+}